@@ -0,0 +1,210 @@
+#include "CostModel.h"
+#include "RotationPlanner.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdlib>
+#include <algorithm>
+
+static double to_mb(size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+void CostModel::record(const string& name, const string& scope, int level, int slots, int index, int hops) {
+    lock_guard<mutex> guard(lock);
+    ops.push_back({name, scope, phase, level, slots, index, hops});
+}
+
+void CostModel::begin_phase(const string& key_file, int bootstrap_slots) {
+    lock_guard<mutex> guard(lock);
+    phase = key_file;
+    if (find(phases.begin(), phases.end(), key_file) == phases.end()) {
+        phases.push_back(key_file);
+    }
+    if (bootstrap_slots > 0) {
+        phase_bootstrap_slots[key_file] = bootstrap_slots;
+    }
+}
+
+bool CostModel::load_timings(const string& filename) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    string line;
+    while (getline(file, line)) {
+        istringstream row(line);
+        string name;
+        row >> name;
+
+        if (name == "key_bytes") {
+            row >> key_bytes;
+        } else if (name == "bootstrap_level") {
+            row >> bootstrap_level;
+        } else if (!name.empty()) {
+            int level, slots;
+            double microseconds;
+            if (row >> level >> slots >> microseconds) {
+                timings[{name, level, slots}] = microseconds;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool CostModel::save_timings(const string& filename, const vector<Tracer::Event>& events, size_t key_bytes, int bootstrap_level) {
+    //Mean duration of each operation, by level and slots
+    map<tuple<string, int, int>, pair<int64_t, int>> totals;
+    for (const Tracer::Event& e : events) {
+        if (string(e.category) == "scope") continue;
+
+        auto& total = totals[{e.name, e.level, e.slots}];
+        total.first += e.duration_us;
+        total.second++;
+    }
+
+    ofstream file(filename);
+    for (const auto& [key, total] : totals) {
+        file << get<0>(key) << " " << get<1>(key) << " " << get<2>(key) << " " << static_cast<double>(total.first) / total.second << "\n";
+    }
+    file << "key_bytes " << key_bytes << "\n";
+    file << "bootstrap_level " << bootstrap_level << "\n";
+
+    return static_cast<bool>(file);
+}
+
+double CostModel::predicted_us(const Op& op) const {
+    auto exact = timings.find({op.name, op.level, op.slots});
+    if (exact != timings.end()) {
+        return exact->second;
+    }
+
+    double nearest = 0;
+    int nearest_distance = -1;
+    bool same_slots = false;
+
+    for (const auto& [key, microseconds] : timings) {
+        if (get<0>(key) != op.name) continue;
+
+        bool slots_match = get<2>(key) == op.slots;
+        int distance = abs(get<1>(key) - op.level);
+
+        if ((slots_match && !same_slots) || (slots_match == same_slots && (nearest_distance < 0 || distance < nearest_distance))) {
+            nearest = microseconds;
+            nearest_distance = distance;
+            same_slots = slots_match;
+        }
+    }
+
+    return nearest;
+}
+
+double CostModel::predicted_cost_us(const Op& op) const {
+    if (op.hops <= 0) {
+        return 0;
+    }
+
+    double us = predicted_us(op);
+    if (op.hops > 1) {
+        us += (op.hops - 1) * predicted_us({"rotate", op.scope, op.phase, op.level, op.slots, op.index, 1});
+    }
+    return us;
+}
+
+vector<pair<string, map<int, int>>> CostModel::rotations_by_phase() {
+    lock_guard<mutex> guard(lock);
+
+    map<string, map<int, int>> rotations;
+    for (const Op& op : ops) {
+        if (op.name == "rotate" || op.name == "fast_rotate") rotations[op.phase][op.index]++;
+    }
+
+    vector<pair<string, map<int, int>>> ordered;
+    for (const string& key_file : phases) {
+        ordered.emplace_back(key_file, rotations[key_file]);
+    }
+    return ordered;
+}
+
+void CostModel::print_report() {
+    //Predicted time, by layer (top-level scope)
+    map<string, pair<int, double>> layers;
+    double total_us = 0;
+    int missing = 0;
+
+    {
+        lock_guard<mutex> guard(lock);
+        for (const Op& op : ops) {
+            double us = predicted_cost_us(op);
+            if (us == 0 && op.hops > 0) missing++;
+
+            string layer = op.scope.substr(0, op.scope.find('/'));
+            auto& [count, layer_us] = layers[layer.empty() ? "-" : layer];
+            count++;
+            layer_us += us;
+            total_us += us;
+        }
+    }
+
+    cout << left << setw(16) << "Scope" << right << setw(10) << "Ops" << setw(18) << "Predicted (s)" << endl;
+    cout << fixed << setprecision(2);
+    for (const auto& [layer, total] : layers) {
+        cout << left << setw(16) << layer << right << setw(10) << total.first << setw(18) << total.second / 1e6 << endl;
+    }
+    cout << left << setw(16) << "Total" << right << setw(10) << ops.size() << setw(18) << total_us / 1e6 << endl;
+
+    if (missing > 0) {
+        cout << missing << " operations have no timing, measure the table with \"timings\" on this host" << endl;
+    }
+
+    //Rotation keys of each phase (the bootstrapping keys are generated by OpenFHE and listed apart)
+    string peak_phase;
+    size_t peak_bytes = 0;
+
+    cout << endl << "Rotation keys by phase:" << endl;
+    for (const auto& [key_file, rotations] : rotations_by_phase()) {
+        size_t bytes = rotations.size() * key_bytes;
+        if (bytes >= peak_bytes) {
+            peak_bytes = bytes;
+            peak_phase = key_file;
+        }
+
+        cout << key_file << ": " << rotations.size() << " keys";
+        if (key_bytes > 0) cout << " (" << to_mb(bytes) << " MB)";
+        if (phase_bootstrap_slots.count(key_file)) cout << " + bootstrapping keys for " << phase_bootstrap_slots[key_file] << " slots";
+        cout << " {";
+        for (auto it = rotations.begin(); it != rotations.end(); ++it) {
+            cout << (it == rotations.begin() ? "" : ", ") << it->first;
+        }
+        cout << "}" << endl;
+    }
+
+    if (key_bytes > 0) {
+        cout << "Peak rotation key memory: " << to_mb(peak_bytes) << " MB, in " << peak_phase << endl;
+    }
+    cout.unsetf(ios::fixed);
+
+    //Rotations composed of many keys, each of them is a key switching
+    map<pair<string, int>, pair<int, int>> long_routes;
+    {
+        lock_guard<mutex> guard(lock);
+        for (const Op& op : ops) {
+            if (op.hops <= static_cast<int>(RotationPlanner::LONG_ROUTE)) continue;
+
+            auto& [hops, count] = long_routes[{op.phase, op.index}];
+            hops = op.hops;
+            count++;
+        }
+    }
+
+    if (!long_routes.empty()) {
+        cout << endl << "Rotations composed of more than " << RotationPlanner::LONG_ROUTE << " keys:" << endl;
+        for (const auto& [route, hops] : long_routes) {
+            cout << route.first << ": rotation " << route.second << ", " << hops.first << " keys, " << hops.second << " times" << endl;
+        }
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef LOWMEMORYFHERESNET20_COSTMODEL_H
+#define LOWMEMORYFHERESNET20_COSTMODEL_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <mutex>
+
+#include "Tracer.h"
+
+using namespace std;
+
+/*
+ * Cost model of the network, used by the dry run of FHEController: operations are not computed, but recorded with
+ * their level, slots, rotation index, layer/block scope and key phase (the key file loaded when they run).
+ *
+ * The timing table ("op level slots microseconds" lines) is measured once on the host, from a traced inference, and
+ * gives the predicted time of each layer. The rotations of each key phase give the exact key set of the phase and,
+ * with the size of a rotation key (also in the table), its memory.
+ */
+class CostModel {
+public:
+    struct Op {
+        string name;
+        string scope;
+        string phase;
+        int level;
+        int slots;
+        int index;
+        //Key switchings of a rotation composed from the keys of the phase (the first one is the op itself)
+        int hops;
+    };
+
+    void record(const string& name, const string& scope, int level, int slots, int index = 0, int hops = 1);
+
+    //Every following operation uses the keys of the given file
+    void begin_phase(const string& key_file, int bootstrap_slots);
+
+    bool load_timings(const string& filename);
+    static bool save_timings(const string& filename, const vector<Tracer::Event>& events, size_t key_bytes, int bootstrap_level);
+
+    //Rotation indices used in each key phase (index -> number of times), in the order the phases are loaded
+    vector<pair<string, map<int, int>>> rotations_by_phase();
+
+    void print_report();
+
+    //Measured on the host, -1/0 if the timing table does not have them
+    int bootstrap_level = -1;
+    size_t key_bytes = 0;
+
+private:
+    vector<Op> ops;
+    string phase = "-";
+    vector<string> phases;
+    map<string, int> phase_bootstrap_slots;
+    map<tuple<string, int, int>, double> timings;
+    mutex lock;
+
+    //Same op and slots at the nearest level, or the same op at any level, or zero
+    double predicted_us(const Op& op) const;
+    //Also counts the key switchings after the first one of a composed rotation, as rotations
+    double predicted_cost_us(const Op& op) const;
+};
+
+
+#endif //LOWMEMORYFHERESNET20_COSTMODEL_H
@@ -4,6 +4,25 @@
 
 #include "FHEController.h"
 
+//Output channels whose convolution dot products are computed in a single pass (must divide 16)
+static const int MAC_TILE = 4;
+
+//Words of each limb processed at a time by mac_taps: 9 taps x 2 polynomials x 2048 words = 288KB, within L2
+static const size_t MAC_BLOCK = 2048;
+
+//Levels consumed by the second iteration of a double bootstrapping (the ModReduce and the mult by 1/2^p)
+static const int DOUBLE_BOOTSTRAP_LEVELS = 2;
+
+/*
+ * SchemeBase does not expose its FHE object (where the bootstrapping precomputations live), but m_FHE is protected:
+ * a pointer to it can be taken from a derived class, and then used on any SchemeBase
+ */
+struct SchemeFHEAccess : public SchemeBase<DCRTPoly> {
+    static std::shared_ptr<FHEBase<DCRTPoly>> get(const SchemeBase<DCRTPoly>& scheme) {
+        return scheme.*(&SchemeFHEAccess::m_FHE);
+    }
+};
+
 void FHEController::generate_context(bool serialize) {
     CCParams<CryptoContextCKKSRNS> parameters;
 
@@ -60,18 +79,29 @@ void FHEController::generate_context(bool serialize) {
 
     cout << "Now serializing keys ..." << endl;
 
-    ofstream multKeyFile("../" + parameters_folder + "/mult-keys.txt", ios::out | ios::binary);
-    if (multKeyFile.is_open()) {
-        if (!context->SerializeEvalMultKey(multKeyFile, SerType::BINARY)) {
-            cerr << "Error writing eval mult keys" << std::endl;
+    write_key_format();
+
+    if (use_seeded_keys) {
+        if (!seeded::serialize_mult_keys("../" + parameters_folder + "/mult-keys.seeded",
+                                         context->GetEvalMultKeyVector(key_pair.secretKey->GetKeyTag()), key_pair.secretKey)) {
+            cerr << "Error serializing EvalMult keys in \"" << "../" + parameters_folder + "/mult-keys.seeded" << "\"" << endl;
+            exit(1);
+        }
+        cout << "EvalMult keys have been serialized (seed-compressed)" << std::endl;
+    } else {
+        ofstream multKeyFile("../" + parameters_folder + "/mult-keys.txt", ios::out | ios::binary);
+        if (multKeyFile.is_open()) {
+            if (!context->SerializeEvalMultKey(multKeyFile, SerType::BINARY)) {
+                cerr << "Error writing eval mult keys" << std::endl;
+                exit(1);
+            }
+            cout << "Relinearization Keys have been serialized" << std::endl;
+            multKeyFile.close();
+        }
+        else {
+            cerr << "Error serializing EvalMult keys in \"" << "../" + parameters_folder + "/mult-keys.txt" << "\"" << endl;
             exit(1);
         }
-        cout << "Relinearization Keys have been serialized" << std::endl;
-        multKeyFile.close();
-    }
-    else {
-        cerr << "Error serializing EvalMult keys in \"" << "../" + parameters_folder + "/mult-keys.txt" << "\"" << endl;
-        exit(1);
     }
 
     if (!Serial::SerializeToFile("../" + parameters_folder + "/crypto-context.txt", context, SerType::BINARY)) {
@@ -158,17 +188,28 @@ void FHEController::generate_context(int log_ring, int log_scale, int log_primes
 
     cout << "Now serializing keys ..." << endl;
 
-    ofstream multKeyFile("../" + parameters_folder + "/mult-keys.txt", ios::out | ios::binary);
-    if (multKeyFile.is_open()) {
-        if (!context->SerializeEvalMultKey(multKeyFile, SerType::BINARY)) {
-            cerr << "Error writing EvalMult keys" << std::endl;
+    write_key_format();
+
+    if (use_seeded_keys) {
+        if (!seeded::serialize_mult_keys("../" + parameters_folder + "/mult-keys.seeded",
+                                         context->GetEvalMultKeyVector(key_pair.secretKey->GetKeyTag()), key_pair.secretKey)) {
+            cerr << "Error serializing EvalMult keys in \"" << "../" + parameters_folder + "/mult-keys.seeded" << "\"" << endl;
             exit(1);
         }
-        cout << "EvalMult keys have been serialized" << std::endl;
-        multKeyFile.close();
+        cout << "EvalMult keys have been serialized (seed-compressed)" << std::endl;
     } else {
-        cerr << "Error serializing EvalMult keys in \"" << "../" + parameters_folder + "/mult-keys.txt" << "\"" << endl;
-        exit(1);
+        ofstream multKeyFile("../" + parameters_folder + "/mult-keys.txt", ios::out | ios::binary);
+        if (multKeyFile.is_open()) {
+            if (!context->SerializeEvalMultKey(multKeyFile, SerType::BINARY)) {
+                cerr << "Error writing EvalMult keys" << std::endl;
+                exit(1);
+            }
+            cout << "EvalMult keys have been serialized" << std::endl;
+            multKeyFile.close();
+        } else {
+            cerr << "Error serializing EvalMult keys in \"" << "../" + parameters_folder + "/mult-keys.txt" << "\"" << endl;
+            exit(1);
+        }
     }
 
     if (!Serial::SerializeToFile("../" + parameters_folder + "/crypto-context.txt", context, SerType::BINARY)) {
@@ -191,6 +232,8 @@ void FHEController::generate_context(int log_ring, int log_scale, int log_primes
 }
 
 void FHEController::load_context(bool verbose) {
+    KeyAllocation allocation;
+
     context->ClearEvalMultKeys();
     context->ClearEvalAutomorphismKeys();
 
@@ -203,31 +246,104 @@ void FHEController::load_context(bool verbose) {
         exit(1);
     }
 
+    //Keys only depend on the context, so they are decoded concurrently
     PublicKey<DCRTPoly> clientPublicKey;
-    if (!Serial::DeserializeFromFile("../" + parameters_folder + "/public-key.txt", clientPublicKey, SerType::BINARY)) {
+    auto public_key_loaded = std::async(std::launch::async, [&]() {
+        return Serial::DeserializeFromFile("../" + parameters_folder + "/public-key.txt", clientPublicKey, SerType::BINARY);
+    });
+
+    PrivateKey<DCRTPoly> serverSecretKey;
+    auto secret_key_loaded = std::async(std::launch::async, [&]() {
+        return Serial::DeserializeFromFile("../" + parameters_folder + "/secret-key.txt", serverSecretKey, SerType::BINARY);
+    });
+
+    //Only the format of the last generation, other files may come from a previous key pair
+    key_format = read_key_format();
+    use_seeded_keys = key_format == "seeded";
+
+    if (use_seeded_keys) {
+        vector<EvalKey<DCRTPoly>> seeded_mult_keys;
+        if (!seeded::deserialize_mult_keys("../" + parameters_folder + "/mult-keys.seeded", seeded_mult_keys)) {
+            cerr << "Could not read the seed-compressed EvalMult keys in mult-keys.seeded" << endl;
+            exit(1);
+        }
+        context->InsertEvalMultKey(seeded_mult_keys);
+        if (verbose) cout << "Using seed-compressed keys." << endl;
+    } else {
+        std::ifstream multKeyIStream("../" + parameters_folder + "/mult-keys.txt", ios::in | ios::binary);
+        if (!multKeyIStream.is_open()) {
+            cerr << "Cannot read serialization from " << "mult-keys.txt" << endl;
+            exit(1);
+        }
+        if (!context->DeserializeEvalMultKey(multKeyIStream, SerType::BINARY)) {
+            cerr << "Could not deserialize eval mult key file" << endl;
+            exit(1);
+        }
+    }
+
+    if (!public_key_loaded.get()) {
         cerr << "I cannot read serialized data from public-key.txt" << endl;
         exit(1);
     }
 
-    PrivateKey<DCRTPoly> serverSecretKey;
-    if (!Serial::DeserializeFromFile("../" + parameters_folder + "/secret-key.txt", serverSecretKey, SerType::BINARY)) {
-        cerr << "I cannot read serialized data from public-key.txt" << endl;
+    if (!secret_key_loaded.get()) {
+        cerr << "I cannot read serialized data from secret-key.txt" << endl;
         exit(1);
     }
 
     key_pair.publicKey = clientPublicKey;
     key_pair.secretKey = serverSecretKey;
 
-    std::ifstream multKeyIStream("../" + parameters_folder + "/mult-keys.txt", ios::in | ios::binary);
-    if (!multKeyIStream.is_open()) {
-        cerr << "Cannot read serialization from " << "mult-keys.txt" << endl;
-        exit(1);
+    if (use_huge_pages) {
+        size_t advised = hugepages::advise_keys(context->GetEvalMultKeyVector(key_pair.secretKey->GetKeyTag()));
+        if (verbose) cout << "EvalMult keys: " << advised / (1024 * 1024) << " MB advised for huge pages" << endl;
+    }
+
+    //While generating keys, the store is still being written
+    use_key_store = key_format == "store";
+    if (use_key_store && key_store == nullptr) {
+        key_store = std::make_unique<RotationKeyStore>("../" + parameters_folder + "/rotation-keys.store");
+        if (!key_store->open()) {
+            cerr << "Could not open the key store in " << "../" + parameters_folder + "/rotation-keys.store" << endl;
+            exit(1);
+        }
+        if (verbose) cout << "Using the indexed key store." << endl;
+    } else if (!use_key_store) {
+        key_store.reset();
     }
-    if (!context->DeserializeEvalMultKey(multKeyIStream, SerType::BINARY)) {
-        cerr << "Could not deserialize eval mult key file" << endl;
+
+    load_parameters(verbose);
+}
+
+string FHEController::key_format_filename() const {
+    return "../" + parameters_folder + "/key-format.txt";
+}
+
+void FHEController::write_key_format() {
+    //Same precedence of serialize_rotation_keys
+    key_format = use_key_store ? "store" : use_seeded_keys ? "seeded" : use_binary_keys ? "bin" : "raw";
+    write_to_file(key_format_filename(), key_format);
+}
+
+string FHEController::read_key_format() const {
+    //Folders generated before the format was recorded only have the binary keys
+    ifstream file(key_format_filename());
+    if (!file.is_open()) {
+        return "bin";
+    }
+
+    string format;
+    file >> format;
+
+    if (format != "bin" && format != "seeded" && format != "raw" && format != "store") {
+        cerr << "Unknown key format \"" << format << "\" in " << key_format_filename() << endl;
         exit(1);
     }
 
+    return format;
+}
+
+void FHEController::load_parameters(bool verbose) {
     relu_degree = stoi(read_from_file("../" + parameters_folder + "/relu_degree.txt"));
 
     //level_budget.txt contains "X, Y", X is at(0), Y is at(2)
@@ -245,6 +361,12 @@ void FHEController::load_context(bool verbose) {
     if (verbose) cout << "Circuit depth: " << circuit_depth << ", available multiplications: " << levelsUsedBeforeBootstrap - 2 << endl;
 
     num_slots = 1 << 14;
+
+    key_phases = planned_key_phases();
+    load_bootstrap_policy();
+
+    //The dry run has no keys, it can also predict a policy before the keys are generated again
+    if (!dry_run) check_bootstrap_keys();
 }
 
 void FHEController::test_context() {
@@ -294,11 +416,13 @@ void FHEController::test_context() {
 }
 
 void FHEController::generate_bootstrapping_keys(int bootstrap_slots) {
-    context->EvalBootstrapSetup(level_budget, {0, 0}, bootstrap_slots);
+    context->EvalBootstrapSetup(level_budget_for(bootstrap_slots), {0, 0}, bootstrap_slots);
     context->EvalBootstrapKeyGen(key_pair.secretKey, bootstrap_slots);
 }
 
 void FHEController::generate_rotation_keys(vector<int> rotations, bool serialize, std::string filename) {
+    if (dry_run) return;
+
     if (serialize && filename.size() == 0) {
         cout << "Filename cannot be empty when serializing rotation keys." << endl;
         return;
@@ -307,9 +431,37 @@ void FHEController::generate_rotation_keys(vector<int> rotations, bool serialize
     context->EvalRotateKeyGen(key_pair.secretKey, rotations);
 
     if (serialize) {
+        serialize_rotation_keys(filename, context->GetEvalAutomorphismKeyMap(key_pair.secretKey->GetKeyTag()));
+    }
+}
+
+void FHEController::serialize_rotation_keys(const string &filename, const RotationKeyStore::KeyMap &keys) {
+    if (use_key_store) {
+        if (key_store == nullptr) {
+            key_store = std::make_unique<RotationKeyStore>("../" + parameters_folder + "/rotation-keys.store");
+        }
+        key_store->add_phase(filename, keys);
+    } else if (use_seeded_keys) {
+        if (!seeded::serialize_keys("../" + parameters_folder + "/rot_" + filename + ".seeded", keys, key_pair.secretKey)) {
+            cerr << "Error serializing Rotation keys" << "../" + parameters_folder + "/rot_" + filename + ".seeded" << std::endl;
+            exit(1);
+        }
+        cout << "Rotation keys \"" << filename << "\" have been serialized (seed-compressed)" << std::endl;
+    } else if (!use_binary_keys) {
+        if (!raw::serialize_keys("../" + parameters_folder + "/rot_" + filename + ".raw", keys)) {
+            cerr << "Error serializing Rotation keys" << "../" + parameters_folder + "/rot_" + filename + ".raw" << std::endl;
+            exit(1);
+        }
+        cout << "Rotation keys \"" << filename << "\" have been serialized (raw)" << std::endl;
+    } else {
         ofstream rotationKeyFile("../" + parameters_folder + "/rot_" + filename, ios::out | ios::binary);
         if (rotationKeyFile.is_open()) {
-            if (!context->SerializeEvalAutomorphismKey(rotationKeyFile, SerType::BINARY)) {
+            //Same layout of SerializeEvalAutomorphismKey, so that DeserializeEvalAutomorphismKey can read it
+            std::map<std::string, std::shared_ptr<RotationKeyStore::KeyMap>> tagged_keys;
+            tagged_keys[key_pair.secretKey->GetKeyTag()] = std::make_shared<RotationKeyStore::KeyMap>(keys);
+
+            Serial::Serialize(tagged_keys, rotationKeyFile, SerType::BINARY);
+            if (!rotationKeyFile.good()) {
                 cerr << "Error writing rotation keys" << std::endl;
                 exit(1);
             }
@@ -321,6 +473,108 @@ void FHEController::generate_rotation_keys(vector<int> rotations, bool serialize
     }
 }
 
+void FHEController::generate_keys_pipeline(const vector<KeyPhase> &phases, bool verbose) {
+    auto start_pipeline = start_time();
+
+    //Keys are never appended to a store opened before, which holds the keys of another key pair
+    if (use_key_store) {
+        key_store = std::make_unique<RotationKeyStore>("../" + parameters_folder + "/rotation-keys.store");
+    }
+
+    //The level budget of each bootstrapping is fixed by its keys, the policy is checked against it when loading
+    ofstream budgets(bootstrap_keys_filename());
+    for (const KeyPhase& phase : phases) {
+        if (phase.bootstrap_slots == 0) continue;
+
+        vector<uint32_t> budget = level_budget_for(phase.bootstrap_slots);
+        budgets << phase.bootstrap_slots << " " << budget[0] << " " << budget[1] << "\n";
+    }
+    budgets.close();
+
+    if (!budgets) {
+        cerr << "Could not write the bootstrapping level budgets in \"" << bootstrap_keys_filename() << "\"" << endl;
+        exit(1);
+    }
+
+    uint32_t m = context->GetCyclotomicOrder();
+    string tag = key_pair.secretKey->GetKeyTag();
+
+    /*
+     * All the rotation sets are known up front: keys shared between phases (1, -1, 2, 4, ...) are generated once
+     * and kept in memory only until the last phase that uses them
+     */
+    vector<vector<usint>> phase_indices;
+    map<usint, size_t> last_use;
+
+    for (size_t p = 0; p < phases.size(); p++) {
+        vector<usint> indices;
+        for (int rotation : phases[p].rotations) {
+            usint index = FindAutomorphismIndex2nComplex(rotation, m);
+            indices.push_back(index);
+            last_use[index] = p;
+        }
+        phase_indices.push_back(indices);
+    }
+
+    RotationKeyStore::KeyMap generated;
+
+    for (size_t p = 0; p < phases.size(); p++) {
+        auto start = start_time();
+
+        if (phases[p].bootstrap_slots != 0) {
+            generate_bootstrapping_keys(phases[p].bootstrap_slots);
+        }
+
+        vector<usint> missing;
+        for (usint index : phase_indices[p]) {
+            if (!generated.count(index) && find(missing.begin(), missing.end(), index) == missing.end()) {
+                missing.push_back(index);
+            }
+        }
+
+        //One key per thread, without inserting them in the context
+        vector<EvalKey<DCRTPoly>> new_keys(missing.size());
+
+#pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < missing.size(); i++) {
+            new_keys[i] = context->EvalAutomorphismKeyGen(key_pair.secretKey, {missing[i]})->at(missing[i]);
+        }
+
+        for (size_t i = 0; i < missing.size(); i++) {
+            generated[missing[i]] = new_keys[i];
+        }
+
+        //Bootstrapping keys are the ones in the context
+        RotationKeyStore::KeyMap keys;
+        auto& all_keys = context->GetAllEvalAutomorphismKeys();
+        if (all_keys.count(tag)) {
+            keys = *all_keys.at(tag);
+        }
+        for (usint index : phase_indices[p]) {
+            keys[index] = generated[index];
+        }
+
+        auto start_write = start_time();
+        serialize_rotation_keys(phases[p].filename, keys);
+
+        keys.clear();
+        context->ClearEvalAutomorphismKeys();
+
+        for (usint index : phase_indices[p]) {
+            if (last_use[index] == p) generated.erase(index);
+        }
+
+        if (verbose) {
+            cout << "(" << p + 1 << "/" << phases.size() << ") " << phases[p].filename << ": " << missing.size()
+                 << " new rotation keys, " << phase_indices[p].size() - missing.size() << " reused" << endl;
+            print_duration(start_write, "Writing " + phases[p].filename);
+            print_duration(start, "Phase " + phases[p].filename);
+        }
+    }
+
+    if (verbose) print_duration(start_pipeline, "Generating all the keys");
+}
+
 void FHEController::generate_bootstrapping_and_rotation_keys(vector<int> rotations, int bootstrap_slots, bool serialize, const string& filename) {
     if (serialize && filename.empty()) {
         cout << "Filename cannot be empty when serializing bootstrapping and rotation keys." << endl;
@@ -332,67 +586,562 @@ void FHEController::generate_bootstrapping_and_rotation_keys(vector<int> rotatio
 }
 
 void FHEController::load_bootstrapping_and_rotation_keys(const string& filename, int bootstrap_slots, bool verbose) {
+    if (dry_run) {
+        cost_model.begin_phase(filename, bootstrap_slots);
+        cost_model.record("bootstrap_setup", tracer.current_scope(), -1, bootstrap_slots);
+        cost_model.record("load_keys", tracer.current_scope(), -1, -1);
+        select_key_phase(filename);
+        return;
+    }
+
     if (verbose) cout << endl << "Loading bootstrapping and rotations keys from " << filename << "..." << endl;
 
     auto start = start_time();
+    KeyAllocation allocation;
 
-    context->EvalBootstrapSetup(level_budget, {0, 0}, bootstrap_slots);
+    {
+        Tracer::Span span(tracer, "bootstrap_setup", "io", -1, bootstrap_slots);
+
+        context->EvalBootstrapSetup(level_budget_for(bootstrap_slots), {0, 0}, bootstrap_slots);
+
+        if (memory.running()) {
+            long long bytes = static_cast<long long>(bootstrap_precomputation_size(bootstrap_slots));
+            bootstrap_precomputation_bytes[bootstrap_slots] = bytes;
+            memory.add_bytes("bootstrapping precomputations", bytes);
+        }
+    }
 
     if (verbose)  cout << "(1/2) Bootstrapping precomputations completed!" << endl;
 
 
-    ifstream rotKeyIStream("../" + parameters_folder + "/rot_" + filename, ios::in | ios::binary);
-    if (!rotKeyIStream.is_open()) {
-        cerr << "Cannot read serialization from " << "../" + parameters_folder + "/" << "rot_" << filename << std::endl;
-        exit(1);
+    load_automorphism_keys(filename, verbose);
+    advise_huge_pages(verbose);
+    select_key_phase(filename);
+
+    if (verbose) cout << "(2/2) Rotation keys read!" << endl;
+
+    if (memory.running()) {
+        memory.set_bytes("rotation keys", rotation_key_bytes());
+        memory.report("loaded " + filename);
+    }
+
+    if (verbose) print_duration(start, "Loading bootstrapping pre-computations + rotations");
+
+    if (verbose) cout << endl;
+}
+
+void FHEController::load_rotation_keys(const string& filename, bool verbose, const vector<int>& rotations) {
+    if (dry_run) {
+        cost_model.begin_phase(filename, 0);
+        cost_model.record("load_keys", tracer.current_scope(), -1, -1);
+        select_key_phase(filename);
+        return;
+    }
+
+    if (verbose) cout << endl << "Loading rotations keys from " << filename << "..." << endl;
+
+    auto start = start_time();
+    KeyAllocation allocation;
+
+    load_automorphism_keys(filename, verbose, rotations);
+    advise_huge_pages(verbose);
+    select_key_phase(filename);
+
+    if (memory.running()) {
+        memory.set_bytes("rotation keys", rotation_key_bytes());
+        memory.report("loaded " + filename);
+    }
+
+    if (verbose) {
+        cout << "(1/1) Rotation keys read!" << endl;
+        print_duration(start, "Loading rotation keys");
+        cout << endl;
+    }
+}
+
+void FHEController::load_automorphism_keys(const string& filename, bool verbose, const vector<int>& rotations) {
+    Tracer::Span span(tracer, "load_keys", "io");
+
+    if (hosted_keys.count(filename)) {
+        //The context gets its own map, so that the hosted one is never modified (nor copied on write after fork)
+        auto keys = std::make_shared<RotationKeyStore::KeyMap>();
+        set<usint> indices;
+        for (int rotation : rotations) {
+            indices.insert(FindAutomorphismIndex2nComplex(rotation, context->GetCyclotomicOrder()));
+        }
+
+        for (const auto& [index, key] : *hosted_keys.at(filename)) {
+            if (indices.empty() || indices.count(index)) (*keys)[index] = key;
+        }
+
+        context->InsertEvalAutomorphismKey(keys, key_pair.secretKey->GetKeyTag());
+
+        if (verbose) cout << "Phase \"" << filename << "\": " << keys->size() << " hosted keys attached" << endl;
+        return;
+    }
+
+    if (use_key_store) {
+        //With the key store, it is possible to load only the keys of the given rotations
+        set<usint> indices;
+        for (int rotation : rotations) {
+            indices.insert(FindAutomorphismIndex2nComplex(rotation, context->GetCyclotomicOrder()));
+        }
+
+        auto keys = key_store->load_phase(filename, indices);
+        context->InsertEvalAutomorphismKey(keys, key_pair.secretKey->GetKeyTag());
+
+        if (verbose) {
+            cout << "Phase \"" << filename << "\": " << keys->size() << " keys loaded (" << key_store->shared_keys(filename)
+                 << " shared with other phases), " << key_store->resident_bytes / (1024 * 1024) << " MB of rotation keys resident" << endl;
+        }
+        return;
+    }
+
+    //Only the recorded format: files of other formats may hold the keys of a previous key pair
+    if (key_format == "raw") {
+        auto raw_keys = raw::deserialize_keys("../" + parameters_folder + "/rot_" + filename + ".raw", context);
+        if (raw_keys == nullptr) {
+            cerr << "Cannot read the raw keys in " << "../" + parameters_folder + "/rot_" + filename + ".raw" << endl;
+            exit(1);
+        }
+        context->InsertEvalAutomorphismKey(raw_keys, key_pair.secretKey->GetKeyTag());
+        return;
+    }
+
+    if (key_format == "seeded") {
+        auto seeded_keys = seeded::deserialize_keys("../" + parameters_folder + "/rot_" + filename + ".seeded");
+        if (seeded_keys == nullptr) {
+            cerr << "Cannot read the seed-compressed keys in " << "../" + parameters_folder + "/rot_" + filename + ".seeded" << endl;
+            exit(1);
+        }
+        context->InsertEvalAutomorphismKey(seeded_keys, key_pair.secretKey->GetKeyTag());
+        return;
+    }
+
+    //Keys generated with binary_keys, or before the raw container was the default. The whole file is read with a single
+    //request, then decoded from memory by a single thread, since it is one cereal stream of the whole key map
+    ifstream rotKeyFile("../" + parameters_folder + "/rot_" + filename, ios::in | ios::binary | ios::ate);
+    if (!rotKeyFile.is_open()) {
+        cerr << "Cannot read serialization from " << "../" + parameters_folder + "/" << "rot_" << filename << std::endl;
+        exit(1);
+    }
+
+    string data(static_cast<size_t>(rotKeyFile.tellg()), '\0');
+    rotKeyFile.seekg(0, ios::beg);
+    rotKeyFile.read(&data[0], static_cast<streamsize>(data.size()));
+    rotKeyFile.close();
+
+    istringstream rotKeyIStream(std::move(data));
+
+    if (!context->DeserializeEvalAutomorphismKey(rotKeyIStream, SerType::BINARY)) {
+        cerr << "Could not deserialize eval rot key file" << std::endl;
+        exit(1);
+    }
+}
+
+void FHEController::prefetch_rotation_keys(const string &filename) {
+    if (dry_run) return;
+
+    //Asks the kernel to read the keys of the next phase in the page cache, while the current one is computing
+    string path = key_format == "store" ? "../" + parameters_folder + "/rotation-keys.store" :
+                  key_format == "seeded" ? "../" + parameters_folder + "/rot_" + filename + ".seeded" :
+                  key_format == "raw" ? "../" + parameters_folder + "/rot_" + filename + ".raw" :
+                  "../" + parameters_folder + "/rot_" + filename;
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    ::close(fd);
+}
+
+void FHEController::benchmark_seeded_keys(const string &filename) {
+    string binary_file = "../" + parameters_folder + "/rot_" + filename;
+    string seeded_file = binary_file + ".seeded";
+
+    auto start = start_time();
+    ifstream rotKeyIStream(binary_file, ios::in | ios::binary);
+    if (!rotKeyIStream.is_open() || !context->DeserializeEvalAutomorphismKey(rotKeyIStream, SerType::BINARY)) {
+        cerr << "Cannot read serialization from " << binary_file << " (the keys must be generated with binary_keys)" << std::endl;
+        exit(1);
+    }
+    print_duration(start, "Loading " + filename + " (BINARY)");
+
+    if (!seeded::serialize_keys(seeded_file, context->GetEvalAutomorphismKeyMap(key_pair.secretKey->GetKeyTag()), key_pair.secretKey)) {
+        cerr << "Error serializing Rotation keys" << seeded_file << std::endl;
+        exit(1);
+    }
+    clear_rotation_keys();
+
+    start = start_time();
+    context->InsertEvalAutomorphismKey(seeded::deserialize_keys(seeded_file), key_pair.secretKey->GetKeyTag());
+    print_duration(start, "Loading " + filename + " (seed-compressed)");
+    clear_rotation_keys();
+
+    struct stat binary_stat, seeded_stat;
+    stat(binary_file.c_str(), &binary_stat);
+    stat(seeded_file.c_str(), &seeded_stat);
+
+    cout << "File size: " << binary_stat.st_size / (1024 * 1024) << " MB (BINARY), "
+         << seeded_stat.st_size / (1024 * 1024) << " MB (seed-compressed)" << endl;
+
+    remove(seeded_file.c_str());
+}
+
+void FHEController::advise_huge_pages(bool verbose) {
+    if (!use_huge_pages) {
+        return;
+    }
+
+    const auto& all_keys = context->GetAllEvalAutomorphismKeys();
+    auto tagged = all_keys.find(key_pair.secretKey->GetKeyTag());
+    if (tagged == all_keys.end()) {
+        return;
+    }
+
+    size_t advised = hugepages::advise_keys(*tagged->second);
+
+    if (verbose) {
+        cout << "Rotation keys: " << advised / (1024 * 1024) << " MB advised for huge pages, "
+             << hugepages::huge_page_bytes() / (1024 * 1024) << " MB of the process on huge pages" << endl;
+    }
+}
+
+void FHEController::benchmark_huge_pages(const string &filename) {
+    /*
+     * Times the key switchings of the first rotation of the phase with keys on normal pages, then again after
+     * advising them for huge pages (the allocator is configured in the same way in both cases)
+     */
+    bool huge_pages = use_huge_pages;
+    use_huge_pages = false;
+    load_rotation_keys(filename, false);
+    use_huge_pages = huge_pages;
+
+    Ctxt c = encrypt(vector<double>(num_slots, 0.5), 0, num_slots);
+    const int iterations = 50;
+
+    auto time_rotations = [&]() {
+        Ctxt res = rotate(c, 1);
+        auto start = start_time();
+        for (int i = 0; i < iterations; i++) {
+            res = rotate(c, 1);
+        }
+        return duration_cast<microseconds>(steady_clock::now() - start).count() / 1000.0 / iterations;
+    };
+
+    double normal = time_rotations();
+    cout << "Key switching with normal pages: " << normal << " ms, "
+         << hugepages::huge_page_bytes() / (1024 * 1024) << " MB on huge pages" << endl;
+
+    const auto& all_keys = context->GetAllEvalAutomorphismKeys();
+    size_t advised = hugepages::advise_keys(*all_keys.at(key_pair.secretKey->GetKeyTag()));
+
+    double huge = time_rotations();
+    cout << "Key switching with huge pages:   " << huge << " ms, "
+         << hugepages::huge_page_bytes() / (1024 * 1024) << " MB on huge pages (" << advised / (1024 * 1024) << " MB advised)" << endl;
+
+    cout << "Speedup: " << normal / huge << "x" << endl;
+}
+
+void FHEController::clear_bootstrapping_and_rotation_keys(int bootstrap_num_slots) {
+    if (dry_run) return;
+
+    //This frees more or less 1GB of precomputations
+    auto fhe = std::dynamic_pointer_cast<FHECKKSRNS>(SchemeFHEAccess::get(*context->GetScheme()));
+    if (fhe != nullptr) {
+        fhe->m_bootPrecomMap.erase(bootstrap_num_slots);
+    }
+
+    auto accounted = bootstrap_precomputation_bytes.find(bootstrap_num_slots);
+    if (accounted != bootstrap_precomputation_bytes.end()) {
+        memory.add_bytes("bootstrapping precomputations", -accounted->second);
+        bootstrap_precomputation_bytes.erase(accounted);
+    }
+
+    clear_rotation_keys();
+}
+
+void FHEController::clear_rotation_keys() {
+    if (dry_run) return;
+
+    context->ClearEvalAutomorphismKeys();
+    select_key_phase("");
+
+    if (key_store != nullptr) key_store->resident_bytes = 0;
+
+    //Masks of the next phase have other levels and slots, the ones of this phase would only take memory
+    clear_mask_cache();
+
+    release_memory();
+
+    if (memory.running()) {
+        memory.set_bytes("rotation keys", 0);
+        memory.report("rotation keys cleared");
+    }
+}
+
+vector<KeyPhase> FHEController::default_key_phases() {
+    return {
+        {"rotations-layer1.bin", {1, -1, 32, -32, -1024, 1024}, 16384},
+        {"rotations-layer2-downsample.bin", {1, 2, 4, 8, 64-16, -(1024 - 256), (1024 - 256) * 32, -8192}, 0},
+        {"rotations-layer2.bin", {1, -1, 16, -16, -256}, 8192},
+        {"rotations-layer3-downsample.bin", {1, 2, 4, 32 - 8, -(256 - 64), (256 - 64) * 64, -4096}, 0},
+        //The last set also contains the keys of the average pooling + fully connected layer
+        {"rotations-layer3.bin", {1, -1, 2, 3, 4, 8, -8, 16, 32, 64, -64, 128, 256, 512, 1024, 2048}, 4096}
+    };
+}
+
+string FHEController::key_plan_filename() const {
+    return "../" + parameters_folder + "/rotation-plan.txt";
+}
+
+vector<KeyPhase> FHEController::planned_key_phases() const {
+    //One line per phase: "filename bootstrap_slots rotations..."
+    ifstream file(key_plan_filename());
+    if (!file.is_open()) {
+        return default_key_phases();
+    }
+
+    vector<KeyPhase> phases;
+    string line;
+    while (getline(file, line)) {
+        istringstream row(line);
+        KeyPhase phase;
+        if (!(row >> phase.filename >> phase.bootstrap_slots)) continue;
+
+        int index;
+        while (row >> index) phase.rotations.push_back(index);
+        phases.push_back(phase);
+    }
+
+    return phases;
+}
+
+void FHEController::write_key_plan(double budget_mb) {
+    size_t max_keys = 0;
+    if (budget_mb > 0) {
+        if (cost_model.key_bytes > 0) {
+            max_keys = max<size_t>(1, static_cast<size_t>(budget_mb * 1024 * 1024 / cost_model.key_bytes));
+        } else {
+            cerr << "The timing table has no key size, the key sets are not limited" << endl;
+        }
+    }
+
+    map<string, map<int, int>> requested;
+    for (const auto& [key_file, rotations] : cost_model.rotations_by_phase()) {
+        requested[key_file] = rotations;
+    }
+
+    cout << endl << "Key plan" << (max_keys > 0 ? " (at most " + to_string(max_keys) + " keys per phase)" : "") << ":" << endl;
+
+    vector<KeyPhase> phases = default_key_phases();
+    for (KeyPhase& phase : phases) {
+        //Phases not loaded by the run keep their default keys
+        auto rotations = requested.find(phase.filename);
+        if (rotations == requested.end() || rotations->second.empty()) continue;
+
+        phase.rotations = RotationPlanner::choose_keys(rotations->second, max_keys, rotation_modulus());
+
+        long long requested_rotations = 0;
+        for (const auto& [index, count] : rotations->second) requested_rotations += count;
+
+        cout << phase.filename << ": " << phase.rotations.size() << " keys, "
+             << RotationPlanner::key_switchings(rotations->second, phase.rotations, rotation_modulus())
+             << " key switchings for " << requested_rotations << " rotations" << endl;
+
+        for (const auto& [index, count] : rotations->second) {
+            size_t hops = RotationPlanner::route(index, phase.rotations, rotation_modulus()).size();
+            if (hops > RotationPlanner::LONG_ROUTE) {
+                cout << "  rotation " << index << " is composed of " << hops << " keys (" << count << " times)" << endl;
+            }
+        }
+    }
+
+    ofstream file(key_plan_filename());
+    for (const KeyPhase& phase : phases) {
+        file << phase.filename << " " << phase.bootstrap_slots;
+        for (int index : phase.rotations) file << " " << index;
+        file << "\n";
+    }
+
+    if (!file) {
+        cerr << "Could not write the key plan in \"" << key_plan_filename() << "\"" << endl;
+        exit(1);
+    }
+
+    cout << "Key plan written in " << key_plan_filename() << ", the keys are generated with it by generate_keys." << endl;
+}
+
+int FHEController::rotation_modulus() const {
+    //Every context of the network has ring dimension 2^16, also the missing one of the dry run
+    return context != nullptr ? static_cast<int>(context->GetRingDimension() / 2) : 1 << 15;
+}
+
+bool FHEController::has_rotation_key(int index) const {
+    const auto& all_keys = context->GetAllEvalAutomorphismKeys();
+    auto tagged = all_keys.find(key_pair.secretKey->GetKeyTag());
+    if (tagged == all_keys.end()) return false;
+
+    return tagged->second->count(FindAutomorphismIndex2nComplex(index, context->GetCyclotomicOrder())) > 0;
+}
+
+void FHEController::select_key_phase(const string &filename) {
+    phase_filename = filename;
+    phase_keys.clear();
+    rotation_routes.clear();
+
+    for (const KeyPhase& phase : key_phases) {
+        if (phase.filename != filename) continue;
+
+        //Only the keys actually in the file, which may predate the plan (the dry run has no file, it follows the plan)
+        for (int index : phase.rotations) {
+            if (dry_run || has_rotation_key(index)) phase_keys.push_back(index);
+        }
+    }
+}
+
+const vector<int>& FHEController::rotation_route(int index) {
+    auto route = rotation_routes.find(index);
+    if (route != rotation_routes.end()) {
+        return route->second;
+    }
+
+    //Outside of the known phases every rotation uses its own key, as requested
+    if (phase_keys.empty()) {
+        return rotation_routes[index] = {index};
+    }
+
+    vector<int> composition = RotationPlanner::route(index, phase_keys, rotation_modulus());
+
+    //The dry run also builds the key plan, so a rotation outside of the current one is counted with its own key
+    if (composition.empty() && index % rotation_modulus() != 0 && dry_run) {
+        return rotation_routes[index] = {index};
+    }
+
+    if (composition.empty() && index % rotation_modulus() != 0) {
+        cerr << "The keys of " << phase_filename << " cannot compose the rotation " << index << endl;
+        exit(1);
+    }
+
+    //Reported once per phase, since routes are kept; the dry run lists them in its report instead
+    if (composition.size() > RotationPlanner::LONG_ROUTE && !dry_run) {
+        cerr << "Warning: the rotation " << index << " is composed of " << composition.size() << " keys of "
+             << phase_filename << ", its key is probably missing (regenerate the keys)" << endl;
+    }
+
+    return rotation_routes[index] = composition;
+}
+
+void FHEController::save_timings(const string &filename) {
+    //Size of a single rotation key, from the keys loaded now
+    size_t key_bytes = 0;
+    const auto& all_keys = context->GetAllEvalAutomorphismKeys();
+    auto tagged = all_keys.find(key_pair.secretKey->GetKeyTag());
+    if (tagged != all_keys.end() && !tagged->second->empty()) {
+        key_bytes = rotation_key_bytes() / tagged->second->size();
     }
 
-    if (!context->DeserializeEvalAutomorphismKey(rotKeyIStream, SerType::BINARY)) {
-        cerr << "Could not deserialize eval rot key file" << std::endl;
+    if (!CostModel::save_timings(filename, tracer.recorded_events(), key_bytes, bootstrap_level)) {
+        cerr << "Could not write the timings in \"" << filename << "\"" << endl;
         exit(1);
     }
+}
 
-    if (verbose) cout << "(2/2) Rotation keys read!" << endl;
+void FHEController::release_memory() {
+    //The trim threshold only releases the top of each heap (see configure_limb_recycling), here also the free pages
+    //in the middle of every arena are given back, so that the RSS of the next phase does not start from the peak of
+    //the previous one
+    malloc_trim(0);
+}
 
-    if (verbose) print_duration(start, "Loading bootstrapping pre-computations + rotations");
+size_t FHEController::plaintext_bytes(const ConstPlaintext &p) {
+    if (p == nullptr) return 0;
 
-    if (verbose) cout << endl;
+    const DCRTPoly& element = p->GetElement<DCRTPoly>();
+    return element.GetNumOfElements() * element.GetRingDimension() * sizeof(uint64_t);
 }
 
-void FHEController::load_rotation_keys(const string& filename, bool verbose) {
-    if (verbose) cout << endl << "Loading rotations keys from " << filename << "..." << endl;
+size_t FHEController::bootstrap_precomputation_size(int bootstrap_slots) {
+    //The precomputations are the encoded matrices of the CtoS and StoC linear transforms
+    auto fhe = std::dynamic_pointer_cast<FHECKKSRNS>(SchemeFHEAccess::get(*context->GetScheme()));
+    if (fhe == nullptr) return 0;
 
-    auto start = start_time();
+    auto precom = fhe->m_bootPrecomMap.find(bootstrap_slots);
+    if (precom == fhe->m_bootPrecomMap.end()) return 0;
 
-    ifstream rotKeyIStream("../" + parameters_folder + "/rot_" + filename, ios::in | ios::binary);
-    if (!rotKeyIStream.is_open()) {
-        cerr << "Cannot read serialization from " << "../" + parameters_folder + "/" << "rot_" << filename << std::endl;
-        exit(1);
+    size_t bytes = 0;
+    for (const auto& level : precom->second->m_U0hatTPreFFT) {
+        for (const auto& p : level) bytes += plaintext_bytes(p);
     }
+    for (const auto& level : precom->second->m_U0PreFFT) {
+        for (const auto& p : level) bytes += plaintext_bytes(p);
+    }
+    for (const auto& p : precom->second->m_U0hatTPre) bytes += plaintext_bytes(p);
+    for (const auto& p : precom->second->m_U0Pre) bytes += plaintext_bytes(p);
 
-    if (!context->DeserializeEvalAutomorphismKey(rotKeyIStream, SerType::BINARY)) {
-        cerr << "Could not deserialize eval rot key file" << std::endl;
-        exit(1);
+    return bytes;
+}
+
+size_t FHEController::ciphertext_bytes(const Ctxt &c) {
+    size_t bytes = 0;
+    for (const DCRTPoly& element : c->GetElements()) {
+        bytes += element.GetNumOfElements() * element.GetRingDimension() * sizeof(uint64_t);
     }
+    return bytes;
+}
 
-    if (verbose) {
-        cout << "(1/1) Rotation keys read!" << endl;
-        print_duration(start, "Loading rotation keys");
-        cout << endl;
+size_t FHEController::rotation_key_bytes() {
+    const auto& all_keys = context->GetAllEvalAutomorphismKeys();
+    auto tagged = all_keys.find(key_pair.secretKey->GetKeyTag());
+    if (tagged == all_keys.end()) {
+        return 0;
+    }
+
+    //Each key is a pair of vectors of polynomials over the extended basis QP
+    size_t bytes = 0;
+    for (const auto& [index, key] : *tagged->second) {
+        auto relin = std::dynamic_pointer_cast<EvalKeyRelinImpl<DCRTPoly>>(key);
+        for (const DCRTPoly& poly : relin->GetAVector()) {
+            bytes += 2 * poly.GetNumOfElements() * poly.GetRingDimension() * sizeof(uint64_t);
+        }
     }
+    return bytes;
 }
 
-void FHEController::clear_bootstrapping_and_rotation_keys(int bootstrap_num_slots) {
-    //This lines would free more or less 1GB or precomputations, but requires access to the GetFHE function
+void FHEController::host_keys(const vector<string> &filenames, bool verbose) {
+    auto start = start_time();
+    KeyAllocation allocation;
 
-    //FHECKKSRNS* derivedPtr = dynamic_cast<FHECKKSRNS*>(context->GetScheme()->GetFHE().get());
-    //derivedPtr->m_bootPrecomMap.erase(bootstrap_num_slots);
-    
-    clear_rotation_keys();
+    /*
+     * Every phase is loaded through the usual path, then detached from the context. Keys shared between phases
+     * (e.g. the bootstrapping ones) are kept once: the same EvalKey is referenced by all the phases that use it.
+     */
+    map<usint, EvalKey<DCRTPoly>> unique_keys;
+    string tag = key_pair.secretKey->GetKeyTag();
+
+    for (const string& filename : filenames) {
+        load_automorphism_keys(filename, false);
+
+        auto keys = std::make_shared<RotationKeyStore::KeyMap>();
+        for (const auto& [index, key] : context->GetEvalAutomorphismKeyMap(tag)) {
+            auto inserted = unique_keys.insert({index, key});
+            (*keys)[index] = inserted.first->second;
+        }
+
+        clear_rotation_keys();
+        hosted_keys[filename] = keys;
+    }
+
+    if (verbose) {
+        cout << filenames.size() << " phases hosted, " << unique_keys.size() << " distinct keys" << endl;
+        print_duration(start, "Hosting the keys");
+    }
 }
 
-void FHEController::clear_rotation_keys() {
-    context->ClearEvalAutomorphismKeys();
+void FHEController::close_key_store() {
+    if (key_store != nullptr) {
+        key_store->close();
+        key_store.reset();
+    }
 }
 
 void FHEController::clear_context(int bootstrapping_key_slots) {
@@ -412,6 +1161,12 @@ Ptxt FHEController::encode(const vector<double> &vec, int level, int plaintext_n
         plaintext_num_slots = num_slots;
     }
 
+    if (dry_run) {
+        cost_model.record("encode", tracer.current_scope(), level, plaintext_num_slots);
+        return nullptr;
+    }
+
+    Tracer::Span span(tracer, "encode", "op", level, plaintext_num_slots);
     Ptxt p = context->MakeCKKSPackedPlaintext(vec, 1, level, nullptr, plaintext_num_slots);
     p->SetLength(plaintext_num_slots);
     return p;
@@ -422,16 +1177,39 @@ Ptxt FHEController::encode(double val, int level, int plaintext_num_slots) {
         plaintext_num_slots = num_slots;
     }
 
+    if (dry_run) {
+        return encode(vector<double>(), level, plaintext_num_slots);
+    }
+
     vector<double> vec;
     for (int i = 0; i < plaintext_num_slots; i++) {
         vec.push_back(val);
     }
 
+    Tracer::Span span(tracer, "encode", "op", level, plaintext_num_slots);
     Ptxt p = context->MakeCKKSPackedPlaintext(vec, 1, level, nullptr, plaintext_num_slots);
     p->SetLength(plaintext_num_slots);
     return p;
 }
 
+vector<Ptxt> FHEController::encode_many(const vector<vector<double>> &vecs, int level, int plaintext_num_slots) {
+    vector<Ptxt> encoded(vecs.size());
+    if (vecs.empty()) {
+        return encoded;
+    }
+
+    //The first encoding builds the FFT tables of OpenFHE for this number of slots, which are not built thread-safely
+    encoded[0] = encode(vecs[0], level, plaintext_num_slots);
+
+    //Each encoding is a special FFT followed by one NTT per limb, independent of the others
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 1; i < vecs.size(); i++) {
+        encoded[i] = encode(vecs[i], level, plaintext_num_slots);
+    }
+
+    return encoded;
+}
+
 Ctxt FHEController::encrypt(const vector<double> &vec, int level, int plaintext_num_slots) {
     if (plaintext_num_slots == 0) {
         plaintext_num_slots = num_slots;
@@ -439,6 +1217,10 @@ Ctxt FHEController::encrypt(const vector<double> &vec, int level, int plaintext_
 
     Ptxt p = encode(vec, level, plaintext_num_slots);
 
+    if (dry_run) {
+        return dry_ciphertext(level, plaintext_num_slots, 1);
+    }
+
     return context->Encrypt(p, key_pair.publicKey);
 }
 
@@ -446,6 +1228,82 @@ Ctxt FHEController::encrypt_ptxt(const Ptxt& p) {
     return context->Encrypt(p, key_pair.publicKey);
 }
 
+void FHEController::serialize_input_seeded(const vector<double> &vec, int level, const string &filename) {
+    //Seed compression requires the secret key encryption
+    Ctxt c = context->Encrypt(key_pair.secretKey, encode(vec, level, num_slots));
+
+    if (!seeded::serialize_ciphertext(filename, c, key_pair.secretKey)) {
+        cerr << "Error serializing the input in \"" << filename << "\"" << endl;
+        exit(1);
+    }
+}
+
+Ctxt FHEController::deserialize_input_seeded(const string &filename) {
+    Ctxt c;
+    if (!seeded::deserialize_ciphertext(filename, c)) {
+        cerr << "Could not deserialize the input from \"" << filename << "\"" << endl;
+        exit(1);
+    }
+    return c;
+}
+
+string FHEController::checkpoint_filename(const string &name) const {
+    //Only the "raw" argument selects the format, so it is known before any key is loaded (e.g. to resume)
+    return "../checkpoints/" + name + (use_raw_format ? ".raw" : ".bin");
+}
+
+void FHEController::save_checkpoint(const Ctxt &c, const string &name, int mults_needed) {
+    //Only the levels needed by the next layer are stored
+    Ctxt trimmed = level_reduce(c, mults_needed);
+
+    //One checkpoint at a time is written, while the inference goes on
+    wait_checkpoint();
+
+    string filename = checkpoint_filename(name);
+    pending_checkpoint_name = filename;
+    pending_checkpoint = std::async(std::launch::async, [this, trimmed, filename]() {
+        //Written in a temporary file and then renamed, so that a checkpoint on disk is always complete
+        string temporary = filename + ".tmp";
+
+        bool saved = use_raw_format ? raw::serialize_ciphertext(temporary, trimmed) :
+                     Serial::SerializeToFile(temporary, trimmed, SerType::BINARY);
+
+        return saved && rename(temporary.c_str(), filename.c_str()) == 0;
+    });
+}
+
+void FHEController::wait_checkpoint() {
+    if (!pending_checkpoint.valid()) {
+        return;
+    }
+
+    if (!pending_checkpoint.get()) {
+        cerr << "Could not write the checkpoint \"" << pending_checkpoint_name << "\"" << endl;
+        exit(1);
+    }
+}
+
+bool FHEController::has_checkpoint(const string &name) {
+    struct stat sb;
+    return stat(checkpoint_filename(name).c_str(), &sb) == 0;
+}
+
+Ctxt FHEController::load_checkpoint(const string &name) {
+    wait_checkpoint();
+
+    string filename = checkpoint_filename(name);
+
+    Ctxt c;
+    bool loaded = use_raw_format ? raw::deserialize_ciphertext(filename, context, c) :
+                  Serial::DeserializeFromFile(filename, c, SerType::BINARY);
+
+    if (!loaded) {
+        cerr << "Could not read the checkpoint \"" << filename << "\"" << endl;
+        exit(1);
+    }
+    return c;
+}
+
 Ptxt FHEController::decrypt(const Ctxt &c) {
     Ptxt p;
     context->Decrypt(key_pair.secretKey, c, &p);
@@ -457,6 +1315,10 @@ vector<double> FHEController::decrypt_tovector(const Ctxt &c, int slots) {
         slots = num_slots;
     }
 
+    if (dry_run) {
+        return vector<double>(slots, 0);
+    }
+
     Ptxt p;
     context->Decrypt(key_pair.secretKey, c, &p);
     p->SetSlots(slots);
@@ -468,44 +1330,440 @@ vector<double> FHEController::decrypt_tovector(const Ctxt &c, int slots) {
 /*
  * Homomorphic operations
  */
+int FHEController::rescaled_level(const Ctxt &c) {
+    //With FLEXIBLEAUTO a product is rescaled by the next multiplication
+    return static_cast<int>(c->GetLevel()) + (c->GetNoiseScaleDeg() > 1 ? 1 : 0);
+}
+
+int FHEController::dry_bootstrap_level() const {
+    //Measured on the host when available, otherwise the levels left are the ones reserved before the bootstrapping
+    if (cost_model.bootstrap_level >= 0) {
+        return cost_model.bootstrap_level;
+    }
+    return circuit_depth - (get_relu_depth(relu_degree) + 3);
+}
+
+Ctxt FHEController::dry_ciphertext(int level, int slots, int noise_scale_deg) {
+    Ctxt c = std::make_shared<CiphertextImpl<DCRTPoly>>();
+    c->SetLevel(level);
+    c->SetSlots(slots);
+    c->SetNoiseScaleDeg(noise_scale_deg);
+    return c;
+}
+
+Ctxt FHEController::dry_op(const char* name, const Ctxt &c, int level, int noise_scale_deg, int index, int hops) {
+    cost_model.record(name, tracer.current_scope(), c->GetLevel(), c->GetSlots(), index, hops);
+    return dry_ciphertext(level, c->GetSlots(), noise_scale_deg);
+}
+
 Ctxt FHEController::add(const Ctxt &c1, const Ctxt &c2) {
+    if (dry_run) {
+        return dry_op("add", c1, max(c1->GetLevel(), c2->GetLevel()), max(c1->GetNoiseScaleDeg(), c2->GetNoiseScaleDeg()));
+    }
+
+    Tracer::Span span(tracer, "add", "op", c1->GetLevel(), c1->GetSlots());
     return context->EvalAdd(c1, c2);
 }
 
+Ctxt FHEController::add(const Ctxt &c, const Ptxt &p) {
+    if (dry_run) {
+        return dry_op("add", c, c->GetLevel(), c->GetNoiseScaleDeg());
+    }
+
+    Tracer::Span span(tracer, "add", "op", c->GetLevel(), c->GetSlots());
+    return context->EvalAdd(c, p);
+}
+
+void FHEController::add_inplace(Ctxt &c1, const Ctxt &c2) {
+    if (dry_run) {
+        c1 = dry_op("add_inplace", c1, max(c1->GetLevel(), c2->GetLevel()), max(c1->GetNoiseScaleDeg(), c2->GetNoiseScaleDeg()));
+        return;
+    }
+
+    Tracer::Span span(tracer, "add_inplace", "op", c1->GetLevel(), c1->GetSlots());
+
+    //A ciphertext referenced by other handles (e.g. the input of the caller) must not be modified
+    if (c1.use_count() > 1) {
+        c1 = context->EvalAdd(c1, c2);
+        return;
+    }
+
+    context->EvalAddInPlace(c1, c2);
+}
+
+void FHEController::add_inplace(Ctxt &c, const Ptxt &p) {
+    if (dry_run) {
+        c = dry_op("add_inplace", c, c->GetLevel(), c->GetNoiseScaleDeg());
+        return;
+    }
+
+    Tracer::Span span(tracer, "add_inplace", "op", c->GetLevel(), c->GetSlots());
+
+    if (c.use_count() > 1) {
+        c = context->EvalAdd(c, p);
+        return;
+    }
+
+    context->EvalAddInPlace(c, p);
+}
+
+Ctxt FHEController::add_many(const vector<Ctxt> &c) {
+    if (dry_run) {
+        size_t level = 0, noise_scale_deg = 1;
+        for (const Ctxt& element : c) {
+            level = max(level, element->GetLevel());
+            noise_scale_deg = max(noise_scale_deg, element->GetNoiseScaleDeg());
+        }
+        return dry_op("add_many", c[0], level, noise_scale_deg);
+    }
+
+    Tracer::Span span(tracer, "add_many", "op", c[0]->GetLevel(), c[0]->GetSlots());
+    return context->EvalAddMany(c);
+}
+
+vector<vector<Ptxt>> FHEController::encode_taps(int channels, const std::function<vector<double>(int, int)>& read_tap, int level, int plaintext_num_slots) {
+    if (dry_run) {
+        for (int i = 0; i < channels * 9; i++) encode(vector<double>(), level, plaintext_num_slots);
+        return vector<vector<Ptxt>>(channels, vector<Ptxt>(9));
+    }
+
+    vector<vector<double>> values(channels * 9);
+    for (int c = 0; c < channels; c++) {
+        for (int k = 0; k < 9; k++) {
+            values[c * 9 + k] = read_tap(c, k);
+        }
+    }
+
+    vector<Ptxt> encoded = encode_many(values, level, plaintext_num_slots);
+
+    vector<vector<Ptxt>> weights(channels);
+    for (int c = 0; c < channels; c++) {
+        weights[c].assign(encoded.begin() + c * 9, encoded.begin() + (c + 1) * 9);
+    }
+
+    return weights;
+}
+
+vector<Ctxt> FHEController::mac_taps(const vector<Ctxt> &taps, const vector<vector<Ptxt>> &weights) {
+    if (dry_run) {
+        cost_model.record("mac_taps", tracer.current_scope(), taps[0]->GetLevel(), taps[0]->GetSlots(), weights.size());
+
+        vector<Ctxt> results;
+        for (size_t j = 0; j < weights.size(); j++) {
+            results.push_back(dry_ciphertext(rescaled_level(taps[0]), taps[0]->GetSlots(), 2));
+        }
+        return results;
+    }
+
+    Tracer::Span span(tracer, "mac_taps", "op", taps[0]->GetLevel(), taps[0]->GetSlots());
+
+    //Level, scaling factor and noise degree of the products, as computed by OpenFHE
+    Ctxt reference = context->EvalMult(taps[0], weights[0][0]);
+
+    const DCRTPoly& first = taps[0]->GetElements()[0];
+    size_t towers = first.GetNumOfElements();
+    size_t ring_dimension = first.GetRingDimension();
+
+    /*
+     * The limbs are multiplied directly only in the plain case: taps at the same level and not waiting for a rescale,
+     * weights at the same level with at least as many towers (the extra ones are dropped, as EvalMult does)
+     */
+    bool direct = reference->GetElements()[0].GetNumOfElements() == towers;
+    for (const Ctxt& tap : taps) {
+        direct = direct && tap->GetNoiseScaleDeg() == 1 && tap->GetLevel() == taps[0]->GetLevel() &&
+                 tap->GetElements().size() == 2 && tap->GetElements()[0].GetNumOfElements() == towers &&
+                 tap->GetElements()[0].GetFormat() == Format::EVALUATION;
+    }
+    for (const vector<Ptxt>& channel : weights) {
+        for (const Ptxt& weight : channel) {
+            const DCRTPoly& element = weight->GetElement<DCRTPoly>();
+            direct = direct && weight->GetLevel() == weights[0][0]->GetLevel() &&
+                     element.GetNumOfElements() >= towers && element.GetFormat() == Format::EVALUATION;
+        }
+    }
+
+    vector<Ctxt> results(weights.size());
+
+    if (!direct) {
+        for (size_t j = 0; j < weights.size(); j++) {
+            vector<Ctxt> k_rows;
+            for (size_t k = 0; k < taps.size(); k++) {
+                k_rows.push_back(j == 0 && k == 0 ? reference : mult(taps[k], weights[j][k]));
+            }
+            results[j] = add_many(k_rows);
+        }
+        return results;
+    }
+
+    vector<NativeInteger> moduli(towers), mus(towers);
+    for (size_t t = 0; t < towers; t++) {
+        moduli[t] = first.GetElementAtIndex(t).GetModulus();
+        mus[t] = moduli[t].ComputeMu();
+    }
+
+    vector<vector<DCRTPoly>> elements(weights.size(), vector<DCRTPoly>(2, DCRTPoly(first.GetParams(), Format::EVALUATION, true)));
+
+    size_t blocks = (ring_dimension + MAC_BLOCK - 1) / MAC_BLOCK;
+
+    /*
+     * A block of every tap (9 x 2 x MAC_BLOCK words) stays in L2 while it is multiplied by the weights of all the
+     * channels of the tile, so the taps are read from memory once per tile instead of once per channel
+     */
+#pragma omp parallel for collapse(2) schedule(static)
+    for (size_t t = 0; t < towers; t++) {
+        for (size_t b = 0; b < blocks; b++) {
+            const NativeInteger& q = moduli[t];
+            const NativeInteger& mu = mus[t];
+            size_t begin = b * MAC_BLOCK;
+            size_t end = min(ring_dimension, begin + MAC_BLOCK);
+
+            for (size_t j = 0; j < weights.size(); j++) {
+                for (size_t p = 0; p < 2; p++) {
+                    NativeInteger* out = &elements[j][p].GetAllElements()[t][0];
+
+                    for (size_t k = 0; k < taps.size(); k++) {
+                        const NativeInteger* tap = &taps[k]->GetElements()[p].GetElementAtIndex(t)[0];
+                        const NativeInteger* weight = &weights[j][k]->GetElement<DCRTPoly>().GetElementAtIndex(t)[0];
+
+                        if (k == 0) {
+                            for (size_t i = begin; i < end; i++) {
+                                out[i] = tap[i].ModMulFast(weight[i], q, mu);
+                            }
+                        } else {
+                            for (size_t i = begin; i < end; i++) {
+                                out[i].ModAddFastEq(tap[i].ModMulFast(weight[i], q, mu), q);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    //Accumulated in the NTT domain without rescaling: the single rescale of each output is left to the next operation
+    for (size_t j = 0; j < weights.size(); j++) {
+        Ctxt result = reference->CloneEmpty();
+        result->SetElements(std::move(elements[j]));
+        result->SetLevel(reference->GetLevel());
+        result->SetNoiseScaleDeg(reference->GetNoiseScaleDeg());
+        result->SetScalingFactor(reference->GetScalingFactor());
+        result->SetScalingFactorInt(reference->GetScalingFactorInt());
+        result->SetSlots(reference->GetSlots());
+        results[j] = result;
+    }
+
+    return results;
+}
+
 Ctxt FHEController::mult(const Ctxt &c1, double d) {
     Ptxt p = encode(d, c1->GetLevel(), num_slots);
+
+    if (dry_run) {
+        return dry_op("mult", c1, rescaled_level(c1), 2);
+    }
+
+    Tracer::Span span(tracer, "mult", "op", c1->GetLevel(), c1->GetSlots());
     return context->EvalMult(c1, p);
 }
 
 Ctxt FHEController::mult(const Ctxt &c, const Ptxt& p) {
+    if (dry_run) {
+        return dry_op("mult", c, rescaled_level(c), 2);
+    }
+
+    Tracer::Span span(tracer, "mult", "op", c->GetLevel(), c->GetSlots());
     return context->EvalMult(c, p);
 }
 
+Ctxt FHEController::rotate(const Ctxt &c, int index) {
+    if (dry_run) {
+        //The requested index is kept for the key plan, the route gives the key switchings actually computed
+        int hops = static_cast<int>(rotation_route(index).size());
+        return dry_op("rotate", c, c->GetLevel(), c->GetNoiseScaleDeg(), index, hops);
+    }
+
+    const vector<int>& route = rotation_route(index);
+    if (route.empty()) return c->Clone();
+
+    //One span per key switching, the timing table gives the cost of a single hop of a composed rotation
+    Ctxt res = c;
+    for (int key : route) {
+        Tracer::Span span(tracer, "rotate", "op", c->GetLevel(), c->GetSlots());
+        res = context->EvalRotate(res, key);
+    }
+    return res;
+}
+
+Ctxt FHEController::fast_rotate(const Ctxt &c, int index, const std::shared_ptr<vector<DCRTPoly>> &digits) {
+    if (dry_run) {
+        int hops = static_cast<int>(rotation_route(index).size());
+        return dry_op("fast_rotate", c, c->GetLevel(), c->GetNoiseScaleDeg(), index, hops);
+    }
+
+    const vector<int>& route = rotation_route(index);
+    if (route.empty()) return c->Clone();
+
+    //The digits belong to c, so only the first key is hoisted
+    Ctxt res;
+    {
+        Tracer::Span span(tracer, "fast_rotate", "op", c->GetLevel(), c->GetSlots());
+        res = context->EvalFastRotation(c, route[0], context->GetCyclotomicOrder(), digits);
+    }
+    for (size_t i = 1; i < route.size(); i++) {
+        Tracer::Span span(tracer, "rotate", "op", c->GetLevel(), c->GetSlots());
+        res = context->EvalRotate(res, route[i]);
+    }
+    return res;
+}
+
+std::shared_ptr<vector<DCRTPoly>> FHEController::fast_rotation_precompute(const Ctxt &c) {
+    if (dry_run) {
+        cost_model.record("fast_rotation_precompute", tracer.current_scope(), c->GetLevel(), c->GetSlots());
+        return nullptr;
+    }
+
+    Tracer::Span span(tracer, "fast_rotation_precompute", "op", c->GetLevel(), c->GetSlots());
+    return context->EvalFastRotationPrecompute(c);
+}
+
+Ctxt FHEController::level_reduce(const Ctxt &c, int mults_needed) {
+    //Drops the towers that will not be used, so that the following key switchings work on less RNS limbs
+    int target_level = circuit_depth - 2 - mults_needed;
+    int current_level = static_cast<int>(c->GetLevel());
+
+    if (current_level >= target_level) {
+        return c;
+    }
+
+    if (dry_run) {
+        return dry_op("level_reduce", c, target_level, c->GetNoiseScaleDeg());
+    }
+
+    return drop_levels(c, target_level - current_level);
+}
+
+Ctxt FHEController::drop_levels(const Ctxt &c, int levels) {
+    size_t towers = c->GetElements()[0].GetNumOfElements();
+
+    /*
+     * LevelReduce only drops towers with FIXEDMANUAL scaling, with the FLEXIBLEAUTO context of the network it gives
+     * back all of them. Compress drops them with any scaling technique (rescaling first if needed)
+     */
+    Ctxt res = context->Compress(c, towers > static_cast<size_t>(levels) ? towers - levels : 1);
+
+    size_t dropped = towers - res->GetElements()[0].GetNumOfElements();
+    if (dropped < static_cast<size_t>(levels)) {
+        cerr << "Dropping " << levels << " levels of a ciphertext with " << towers << " towers removed " << dropped
+             << " of them" << endl;
+        exit(1);
+    }
+
+    return res;
+}
+
+Ctxt FHEController::hold_residual(const Ctxt &c) {
+    //Until a residual of these slots has been added back the level is not known, and nothing is dropped
+    auto consumed = residual_levels.find(static_cast<int>(c->GetSlots()));
+    if (consumed == residual_levels.end()) {
+        return c;
+    }
+
+    int current_level = static_cast<int>(c->GetLevel());
+    int residual_level = consumed->second;
+    if (current_level >= residual_level) {
+        return c;
+    }
+
+    if (dry_run) {
+        return dry_op("level_reduce", c, residual_level, c->GetNoiseScaleDeg());
+    }
+
+    Tracer::Span span(tracer, "level_reduce", "op", current_level, c->GetSlots());
+    Ctxt res = drop_levels(c, residual_level - current_level);
+
+    if (memory.running()) {
+        memory.report("residual held: " + to_string(ciphertext_bytes(c) / (1024 * 1024)) + " MB -> " +
+                      to_string(ciphertext_bytes(res) / (1024 * 1024)) + " MB", ciphertext_bytes(res));
+    }
+
+    return res;
+}
+
+void FHEController::add_residual(Ctxt &c, const Ctxt &residual) {
+    //The blocks of a layer have the same structure, so the next residual is consumed at the same level
+    residual_levels[static_cast<int>(c->GetSlots())] = static_cast<int>(c->GetLevel());
+
+    add_inplace(c, hold_residual(residual));
+}
+
 Ctxt FHEController::bootstrap(const Ctxt &c, bool timing) {
+    string site = bootstrap_site();
+
+    //While calibrating every site is measured with a single iteration
+    auto policy = site_policy.find(site);
+    if (bootstrap_required_bits == 0 && policy != site_policy.end() && policy->second.iterations > 1) {
+        return bootstrap(c, policy->second.precision, timing);
+    }
+
     if (static_cast<int>(c->GetLevel()) + 2 < circuit_depth && timing) {
         cout << "You are bootstrapping with remaining levels! You are at " << to_string(c->GetLevel()) << "/" << circuit_depth - 2 << endl;
     }
 
 
+    if (dry_run) {
+        Ctxt res = dry_op("bootstrap", c, dry_bootstrap_level(), 1);
+        bootstrap_level = static_cast<int>(res->GetLevel());
+        return res;
+    }
+
+    //While calibrating, the input gives the deepest level reached after the previous bootstrapping
+    if (bootstrap_required_bits > 0) {
+        if (!previous_site.empty()) {
+            auto end_level = site_end_level.find(previous_site);
+            int level = static_cast<int>(c->GetLevel());
+            if (end_level == site_end_level.end() || level > end_level->second) site_end_level[previous_site] = level;
+        }
+        previous_site = site;
+    }
+
     auto start = start_time();
+    Tracer::Span span(tracer, "bootstrap", "op", c->GetLevel(), c->GetSlots());
 
     Ctxt res = context->EvalBootstrap(c);
+    bootstrap_level = static_cast<int>(res->GetLevel());
 
     if (timing) {
         print_duration(start, "Bootstrapping " + to_string(c->GetSlots()) + " slots");
     }
 
+    if (bootstrap_required_bits > 0) {
+        //The worst precision of the site, on the actual values of the network
+        double bits = utils::compute_approx_error(decrypt(c), decrypt(res));
+        auto measured = measured_site_bits.find(site);
+        if (measured == measured_site_bits.end() || bits < measured->second) {
+            measured_site_bits[site] = bits;
+        }
+    }
+
     return res;
 }
 
 Ctxt FHEController::bootstrap(const Ctxt &c, int precision, bool timing) {
-    if (static_cast<int>(c->GetLevel()) + 2 < circuit_depth) {
+    if (static_cast<int>(c->GetLevel()) + 2 < circuit_depth && timing) {
         cout << "You are bootstrapping with remaining levels! You are at " << to_string(c->GetLevel()) << "/" << circuit_depth - 2 << endl;
     }
 
+    if (dry_run) {
+        Ctxt res = dry_op("double_bootstrap", c, dry_bootstrap_level(), 1);
+        bootstrap_level = static_cast<int>(res->GetLevel());
+        return res;
+    }
+
     auto start = start_time();
+    Tracer::Span span(tracer, "double_bootstrap", "op", c->GetLevel(), c->GetSlots());
 
     Ctxt res = context->EvalBootstrap(c, 2, precision);
+    bootstrap_level = static_cast<int>(res->GetLevel());
 
     if (timing) {
         print_duration(start, "Double Bootstrapping " + to_string(c->GetSlots()) + " slots");
@@ -515,8 +1773,13 @@ Ctxt FHEController::bootstrap(const Ctxt &c, int precision, bool timing) {
     return res;
 }
 
-Ctxt FHEController::relu(const Ctxt &c, double scale, bool timing) {
+Ctxt FHEController::relu(const Ctxt &c, double scale, bool timing, double output_scale) {
+    if (dry_run) {
+        return dry_op("relu", c, rescaled_level(c) + get_relu_depth(relu_degree), 1);
+    }
+
     auto start = start_time();
+    Tracer::Span span(tracer, "relu", "op", c->GetLevel(), c->GetSlots());
 
     /*
      * Max min
@@ -530,7 +1793,7 @@ Ctxt FHEController::relu(const Ctxt &c, double scale, bool timing) {
      * Max min
      */
 
-    Ctxt res = context->EvalChebyshevFunction([scale](double x) -> double { if (x < 0) return 0; else return (1 / scale) * x; }, c,
+    Ctxt res = context->EvalChebyshevFunction([scale, output_scale](double x) -> double { if (x < 0) return 0; else return (output_scale / scale) * x; }, c,
                                               -1,
                                               1, relu_degree);
 
@@ -542,7 +1805,12 @@ Ctxt FHEController::relu(const Ctxt &c, double scale, bool timing) {
 }
 
 Ctxt FHEController::relu_wide(const Ctxt &c, double a, double b, int degree, double scale, bool timing) {
+    if (dry_run) {
+        return dry_op("relu", c, rescaled_level(c) + get_relu_depth(degree), 1);
+    }
+
     auto start = start_time();
+    Tracer::Span span(tracer, "relu", "op", c->GetLevel(), c->GetSlots());
 
     /*
      * Max min
@@ -586,6 +1854,8 @@ Ctxt FHEController::read_input(const string& filename, double scale) {
 }
 
 void FHEController::print(const Ctxt &c, int slots, string prefix) {
+    if (dry_run) return;
+
     if (slots == 0) {
         slots = num_slots;
     }
@@ -680,58 +1950,56 @@ Ctxt FHEController::convbn_initial(const Ctxt &in, double scale, bool timing) {
     int img_width = 32;
     int padding = 1;
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    auto digits = fast_rotation_precompute(in);
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
     c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), img_width));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), img_width));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), img_width ));
+            rotate(fast_rotate(in, padding, digits), img_width ));
 
     Ptxt bias = encode(read_values_from_file("../weights/conv1bn1-bias.bin", scale), in->GetLevel(), 16384);
 
     Ctxt finalsum;
 
-    generate_rotation_keys({1024});
+    vector<Ctxt> sums;
 
     for (int j = 0; j < 16; j++) {
-        vector<Ctxt> k_rows;
-
-        for (int k = 0; k < 9; k++) {
-            vector<double> values = read_values_from_file("../weights/conv1bn1-ch" +
-                                                          to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            Ptxt encoded = encode(values, in->GetLevel(), 16384);
-            k_rows.push_back(context->EvalMult(c_rotations[k], encoded));
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(MAC_TILE, [&](int c, int k) {
+                return read_values_from_file("../weights/conv1bn1-ch" +
+                                          to_string(j + c) + "-k" + to_string(k+1) + ".bin", scale);
+            }, in->GetLevel(), 16384));
         }
 
-        Ctxt sum = context->EvalAddMany(k_rows);
+        Ctxt sum = sums[j % MAC_TILE];
 
         Ctxt res = sum->Clone();
 
-        res = add(res, context->EvalRotate(sum, 1024));
-        res = add(res, context->EvalRotate(context->EvalRotate(sum, 1024), 1024));
+        add_inplace(res, rotate(sum, 1024));
+        add_inplace(res, rotate(sum, 2048));
         res = mult(res, mask_from_to(0, 1024, res->GetLevel()));
 
 
         if (j == 0) {
             finalsum = res->Clone();
-            finalsum = context->EvalRotate(finalsum, 1024);
+            finalsum = rotate(finalsum, 1024);
         } else {
-            finalsum = context->EvalAdd(finalsum, res);
-            finalsum = context->EvalRotate(finalsum, 1024);
+            add_inplace(finalsum, res);
+            finalsum = rotate(finalsum, 1024);
         }
 
     }
 
-    finalsum = context->EvalAdd(finalsum, bias);
+    add_inplace(finalsum, bias);
 
     if (timing) {
         print_duration(start, "Initial layer");
@@ -741,7 +2009,7 @@ Ctxt FHEController::convbn_initial(const Ctxt &in, double scale, bool timing) {
     return finalsum;
 }
 
-Ctxt FHEController::convbn(const Ctxt &in, int layer, int n, double scale, bool timing) {
+Ctxt FHEController::convbn(const Ctxt &in, int layer, int n, double scale, bool timing, double input_scale) {
     auto start = start_time();
 
     vector<Ctxt> c_rotations;
@@ -749,50 +2017,50 @@ Ctxt FHEController::convbn(const Ctxt &in, int layer, int n, double scale, bool
     int img_width = 32;
     int padding = 1;
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    auto digits = fast_rotation_precompute(in);
 
     //TODO: combinations of rotations in order to perform only 8 rotations
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
     c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), img_width));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), img_width));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), img_width ));
+            rotate(fast_rotate(in, padding, digits), img_width ));
 
     Ptxt bias = encode(read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-bias.bin", scale), in->GetLevel(), 16384);
 
     Ctxt finalsum;
 
-    for (int j = 0; j < 16; j++) {
-        vector<Ctxt> k_rows;
+    vector<Ctxt> sums;
 
-        for (int k = 0; k < 9; k++) {
-            vector<double> values = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                      to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            Ptxt encoded = encode(values, in->GetLevel(), 16384);
-            k_rows.push_back(context->EvalMult(c_rotations[k], encoded));
+    for (int j = 0; j < 16; j++) {
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(MAC_TILE, [&](int c, int k) {
+                return read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
+                                          to_string(j + c) + "-k" + to_string(k+1) + ".bin", scale / input_scale);
+            }, in->GetLevel(), 16384));
         }
 
-        Ctxt sum = context->EvalAddMany(k_rows);
+        Ctxt sum = sums[j % MAC_TILE];
         if (j == 0) {
             finalsum = sum->Clone();
-            finalsum = context->EvalRotate(finalsum, -1024);
+            finalsum = rotate(finalsum, -1024);
         } else {
-            finalsum = context->EvalAdd(finalsum, sum);
-            finalsum = context->EvalRotate(finalsum, -1024);
+            add_inplace(finalsum, sum);
+            finalsum = rotate(finalsum, -1024);
         }
 
     }
 
-    finalsum = context->EvalAdd(finalsum, bias);
+    add_inplace(finalsum, bias);
 
     if (timing) {
         print_duration(start, "Block " + to_string(layer) + " - convbn" + to_string(n));
@@ -801,7 +2069,7 @@ Ctxt FHEController::convbn(const Ctxt &in, int layer, int n, double scale, bool
     return finalsum;
 }
 
-Ctxt FHEController::convbn2(const Ctxt &in, int layer, int n, double scale, bool timing) {
+Ctxt FHEController::convbn2(const Ctxt &in, int layer, int n, double scale, bool timing, double input_scale) {
     auto start = start_time();
 
     vector<Ctxt> c_rotations;
@@ -809,50 +2077,50 @@ Ctxt FHEController::convbn2(const Ctxt &in, int layer, int n, double scale, bool
     int img_width = 16;
     int padding = 1;
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    auto digits = fast_rotation_precompute(in);
 
     //TODO: combinations of rotations in order to perform only 8 rotations
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
     c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), img_width));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), img_width));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), img_width ));
+            rotate(fast_rotate(in, padding, digits), img_width ));
 
     Ptxt bias = encode(read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-bias.bin", scale), circuit_depth-2, 8192);
 
     Ctxt finalsum;
 
-    for (int j = 0; j < 32; j++) {
-        vector<Ctxt> k_rows;
+    vector<Ctxt> sums;
 
-        for (int k = 0; k < 9; k++) {
-            vector<double> values = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                          to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            Ptxt encoded = encode(values, circuit_depth - 2, 8192);
-            k_rows.push_back(context->EvalMult(c_rotations[k], encoded));
+    for (int j = 0; j < 32; j++) {
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(MAC_TILE, [&](int c, int k) {
+                return read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
+                                          to_string(j + c) + "-k" + to_string(k+1) + ".bin", scale / input_scale);
+            }, circuit_depth - 2, 8192));
         }
 
-        Ctxt sum = context->EvalAddMany(k_rows);
+        Ctxt sum = sums[j % MAC_TILE];
         if (j == 0) {
             finalsum = sum->Clone();
-            finalsum = context->EvalRotate(finalsum, -256);
+            finalsum = rotate(finalsum, -256);
         } else {
-            finalsum = context->EvalAdd(finalsum, sum);
-            finalsum = context->EvalRotate(finalsum, -256);
+            add_inplace(finalsum, sum);
+            finalsum = rotate(finalsum, -256);
         }
 
     }
 
-    finalsum = context->EvalAdd(finalsum, bias);
+    add_inplace(finalsum, bias);
 
     if (timing) {
         print_duration(start, "Block " + to_string(layer) + " - convbn" + to_string(n));
@@ -861,7 +2129,7 @@ Ctxt FHEController::convbn2(const Ctxt &in, int layer, int n, double scale, bool
     return finalsum;
 }
 
-Ctxt FHEController::convbn3(const Ctxt &in, int layer, int n, double scale, bool timing) {
+Ctxt FHEController::convbn3(const Ctxt &in, int layer, int n, double scale, bool timing, double input_scale) {
     auto start = start_time();
 
     vector<Ctxt> c_rotations;
@@ -869,50 +2137,50 @@ Ctxt FHEController::convbn3(const Ctxt &in, int layer, int n, double scale, bool
     int img_width = 8;
     int padding = 1;
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    auto digits = fast_rotation_precompute(in);
 
     //TODO: combinations of rotations in order to perform only 8 rotations
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, padding, digits), -img_width ));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
     c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), img_width));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -padding, digits), img_width));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), img_width ));
+            rotate(fast_rotate(in, padding, digits), img_width ));
 
     Ptxt bias = encode(read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-bias.bin", scale), c_rotations[0]->GetLevel(), 4096);
 
     Ctxt finalsum;
 
-    for (int j = 0; j < 64; j++) {
-        vector<Ctxt> k_rows;
+    vector<Ctxt> sums;
 
-        for (int k = 0; k < 9; k++) {
-            vector<double> values = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                          to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            Ptxt encoded = encode(values, c_rotations[0]->GetLevel(), 4096);
-            k_rows.push_back(context->EvalMult(c_rotations[k], encoded));
+    for (int j = 0; j < 64; j++) {
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(MAC_TILE, [&](int c, int k) {
+                return read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
+                                          to_string(j + c) + "-k" + to_string(k+1) + ".bin", scale / input_scale);
+            }, c_rotations[0]->GetLevel(), 4096));
         }
 
-        Ctxt sum = context->EvalAddMany(k_rows);
+        Ctxt sum = sums[j % MAC_TILE];
         if (j == 0) {
             finalsum = sum->Clone();
-            finalsum = context->EvalRotate(finalsum, -64);
+            finalsum = rotate(finalsum, -64);
         } else {
-            finalsum = context->EvalAdd(finalsum, sum);
-            finalsum = context->EvalRotate(finalsum, -64);
+            add_inplace(finalsum, sum);
+            finalsum = rotate(finalsum, -64);
         }
 
     }
 
-    finalsum = context->EvalAdd(finalsum, bias);
+    add_inplace(finalsum, bias);
 
     if (timing) {
         print_duration(start, "Block" + to_string(layer) + " - convbn" + to_string(n));
@@ -929,21 +2197,21 @@ vector<Ctxt> FHEController::convbn1632sx(const Ctxt &in, int layer, int n, doubl
     int img_width = 32;
     int padding = 1;
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    auto digits = fast_rotation_precompute(in);
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -(img_width), context->GetCyclotomicOrder(), digits), -padding));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -(img_width), context->GetCyclotomicOrder(), digits), padding));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), padding));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
     c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, (img_width), context->GetCyclotomicOrder(), digits), -padding));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, (img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, (img_width), context->GetCyclotomicOrder(), digits), padding));
+            rotate(fast_rotate(in, (img_width), digits), padding));
 
     vector<Ctxt> applied_filters16;
     vector<Ctxt> applied_filters32;
@@ -955,39 +2223,37 @@ vector<Ctxt> FHEController::convbn1632sx(const Ctxt &in, int layer, int n, doubl
     Ctxt finalSum016;
     Ctxt finalSum1632;
 
-    for (int j = 0; j < 16; j++) {
-        vector<Ctxt> k_rows016;
-        vector<Ctxt> k_rows1632;
-
-        for (int k = 0; k < 9; k++) {
-            vector<double> values = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                      to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            k_rows016.push_back(context->EvalMult(c_rotations[k], encode(values, in->GetLevel(), 16384)));
+    vector<Ctxt> sums;
 
-            values = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                       to_string(j+16) + "-k" + to_string(k+1) + ".bin", scale);
-            k_rows1632.push_back(context->EvalMult(c_rotations[k], encode(values, in->GetLevel(), 16384)));
+    for (int j = 0; j < 16; j++) {
+        //The tile holds channels j.. of both groups
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(2 * MAC_TILE, [&](int c, int k) {
+                int channel = c < MAC_TILE ? j + c : j + 16 + c - MAC_TILE;
+                return read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
+                                          to_string(channel) + "-k" + to_string(k+1) + ".bin", scale);
+            }, in->GetLevel(), 16384));
         }
 
-        Ctxt sum016 = context->EvalAddMany(k_rows016);
-        Ctxt sum1632 = context->EvalAddMany(k_rows1632);
+        Ctxt sum016 = sums[j % MAC_TILE];
+        Ctxt sum1632 = sums[MAC_TILE + j % MAC_TILE];
 
         if (j == 0) {
             finalSum016 = sum016->Clone();
-            finalSum016 = context->EvalRotate(finalSum016, -1024);
+            finalSum016 = rotate(finalSum016, -1024);
             finalSum1632 = sum1632->Clone();
-            finalSum1632 = context->EvalRotate(finalSum1632, -1024);
+            finalSum1632 = rotate(finalSum1632, -1024);
         } else {
-            finalSum016 = context->EvalAdd(finalSum016, sum016);
-            finalSum016 = context->EvalRotate(finalSum016, -1024);
-            finalSum1632 = context->EvalAdd(finalSum1632, sum1632);
-            finalSum1632 = context->EvalRotate(finalSum1632, -1024);
+            add_inplace(finalSum016, sum016);
+            finalSum016 = rotate(finalSum016, -1024);
+            add_inplace(finalSum1632, sum1632);
+            finalSum1632 = rotate(finalSum1632, -1024);
         }
 
     }
 
-    finalSum016 = context->EvalAdd(finalSum016, bias1);
-    finalSum1632 = context->EvalAdd(finalSum1632, bias2);
+    add_inplace(finalSum016, bias1);
+    add_inplace(finalSum1632, bias2);
 
     if (timing) {
         print_duration(start, "Block " + to_string(layer) + " - convbnSx" + to_string(n));
@@ -1014,32 +2280,32 @@ vector<Ctxt> FHEController::convbn1632dx(const Ctxt &in, int layer, int n, doubl
 
         vector<double> values = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
                                                       to_string(j) + "-k" + to_string(1) + ".bin", scale);
-        k_rows016.push_back(context->EvalMult(in, encode(values, in->GetLevel(), num_slots)));
+        k_rows016.push_back(mult(in, encode(values, in->GetLevel(), num_slots)));
 
         values = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
                                        to_string(j+16) + "-k" + to_string(1) + ".bin", scale);
 
-        k_rows1632.push_back(context->EvalMult(in, encode(values, in->GetLevel(), num_slots)));
+        k_rows1632.push_back(mult(in, encode(values, in->GetLevel(), num_slots)));
 
-        Ctxt sum016 = context->EvalAddMany(k_rows016);
-        Ctxt sum1632 = context->EvalAddMany(k_rows1632);
+        Ctxt sum016 = add_many(k_rows016);
+        Ctxt sum1632 = add_many(k_rows1632);
 
         if (j == 0) {
             finalSum016 = sum016->Clone();
-            finalSum016 = context->EvalRotate(finalSum016, -1024);
+            finalSum016 = rotate(finalSum016, -1024);
             finalSum1632 = sum1632->Clone();
-            finalSum1632 = context->EvalRotate(finalSum1632, -1024);
+            finalSum1632 = rotate(finalSum1632, -1024);
         } else {
-            finalSum016 = context->EvalAdd(finalSum016, sum016);
-            finalSum016 = context->EvalRotate(finalSum016, -1024);
-            finalSum1632 = context->EvalAdd(finalSum1632, sum1632);
-            finalSum1632 = context->EvalRotate(finalSum1632, -1024);
+            add_inplace(finalSum016, sum016);
+            finalSum016 = rotate(finalSum016, -1024);
+            add_inplace(finalSum1632, sum1632);
+            finalSum1632 = rotate(finalSum1632, -1024);
         }
 
     }
 
-    finalSum016 = context->EvalAdd(finalSum016, bias1);
-    finalSum1632 = context->EvalAdd(finalSum1632, bias2);
+    add_inplace(finalSum016, bias1);
+    add_inplace(finalSum1632, bias2);
 
     if (timing) {
         print_duration(start, "Block " + to_string(layer) + " - convbnDx" + to_string(n));
@@ -1056,21 +2322,21 @@ vector<Ctxt> FHEController::convbn3264sx(const Ctxt &in, int layer, int n, doubl
     int img_width = 16;
     int padding = 1;
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    auto digits = fast_rotation_precompute(in);
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -(img_width), context->GetCyclotomicOrder(), digits), -padding));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -(img_width), context->GetCyclotomicOrder(), digits), padding));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), padding));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
     c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, (img_width), context->GetCyclotomicOrder(), digits), -padding));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, (img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, (img_width), context->GetCyclotomicOrder(), digits), padding));
+            rotate(fast_rotate(in, (img_width), digits), padding));
 
     vector<Ctxt> applied_filters32;
     vector<Ctxt> applied_filters64;
@@ -1082,39 +2348,37 @@ vector<Ctxt> FHEController::convbn3264sx(const Ctxt &in, int layer, int n, doubl
     Ctxt finalSum032;
     Ctxt finalSum3264;
 
-    for (int j = 0; j < 32; j++) {
-        vector<Ctxt> k_rows032;
-        vector<Ctxt> k_rows3264;
-
-        for (int k = 0; k < 9; k++) {
-            vector<double> values = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                          to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            k_rows032.push_back(context->EvalMult(c_rotations[k], encode(values, in->GetLevel(), 8192)));
+    vector<Ctxt> sums;
 
-            values = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                           to_string(j+32) + "-k" + to_string(k+1) + ".bin", scale);
-            k_rows3264.push_back(context->EvalMult(c_rotations[k], encode(values, in->GetLevel(), 8192)));
+    for (int j = 0; j < 32; j++) {
+        //The tile holds channels j.. of both groups
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(2 * MAC_TILE, [&](int c, int k) {
+                int channel = c < MAC_TILE ? j + c : j + 32 + c - MAC_TILE;
+                return read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
+                                          to_string(channel) + "-k" + to_string(k+1) + ".bin", scale);
+            }, in->GetLevel(), 8192));
         }
 
-        Ctxt sum032 = context->EvalAddMany(k_rows032);
-        Ctxt sum3264 = context->EvalAddMany(k_rows3264);
+        Ctxt sum032 = sums[j % MAC_TILE];
+        Ctxt sum3264 = sums[MAC_TILE + j % MAC_TILE];
 
         if (j == 0) {
             finalSum032 = sum032->Clone();
-            finalSum032 = context->EvalRotate(finalSum032, -256);
+            finalSum032 = rotate(finalSum032, -256);
             finalSum3264 = sum3264->Clone();
-            finalSum3264 = context->EvalRotate(finalSum3264, -256);
+            finalSum3264 = rotate(finalSum3264, -256);
         } else {
-            finalSum032 = context->EvalAdd(finalSum032, sum032);
-            finalSum032 = context->EvalRotate(finalSum032, -256);
-            finalSum3264 = context->EvalAdd(finalSum3264, sum3264);
-            finalSum3264 = context->EvalRotate(finalSum3264, -256);
+            add_inplace(finalSum032, sum032);
+            finalSum032 = rotate(finalSum032, -256);
+            add_inplace(finalSum3264, sum3264);
+            finalSum3264 = rotate(finalSum3264, -256);
         }
 
     }
 
-    finalSum032 = context->EvalAdd(finalSum032, bias1);
-    finalSum3264 = context->EvalAdd(finalSum3264, bias2);
+    add_inplace(finalSum032, bias1);
+    add_inplace(finalSum3264, bias2);
 
     if (timing) {
         print_duration(start, "Block " + to_string(layer) + " - convbnSx" + to_string(n));
@@ -1141,32 +2405,32 @@ vector<Ctxt> FHEController::convbn3264dx(const Ctxt &in, int layer, int n, doubl
 
         vector<double> values = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
                                                       to_string(j) + "-k" + to_string(1) + ".bin", scale);
-        k_rows032.push_back(context->EvalMult(in, encode(values, in->GetLevel(), 8192)));
+        k_rows032.push_back(mult(in, encode(values, in->GetLevel(), 8192)));
 
         values = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
                                        to_string(j+32) + "-k" + to_string(1) + ".bin", scale);
 
-        k_rows3264.push_back(context->EvalMult(in, encode(values, in->GetLevel(), 8192)));
+        k_rows3264.push_back(mult(in, encode(values, in->GetLevel(), 8192)));
 
-        Ctxt sum032 = context->EvalAddMany(k_rows032);
-        Ctxt sum3264 = context->EvalAddMany(k_rows3264);
+        Ctxt sum032 = add_many(k_rows032);
+        Ctxt sum3264 = add_many(k_rows3264);
 
         if (j == 0) {
             finalSum032 = sum032->Clone();
-            finalSum032 = context->EvalRotate(finalSum032, -256);
+            finalSum032 = rotate(finalSum032, -256);
             finalSum3264 = sum3264->Clone();
-            finalSum3264 = context->EvalRotate(finalSum3264, -256);
+            finalSum3264 = rotate(finalSum3264, -256);
         } else {
-            finalSum032 = context->EvalAdd(finalSum032, sum032);
-            finalSum032 = context->EvalRotate(finalSum032, -256);
-            finalSum3264 = context->EvalAdd(finalSum3264, sum3264);
-            finalSum3264 = context->EvalRotate(finalSum3264, -256);
+            add_inplace(finalSum032, sum032);
+            finalSum032 = rotate(finalSum032, -256);
+            add_inplace(finalSum3264, sum3264);
+            finalSum3264 = rotate(finalSum3264, -256);
         }
 
     }
 
-    finalSum032 = context->EvalAdd(finalSum032, bias1);
-    finalSum3264 = context->EvalAdd(finalSum3264, bias2);
+    add_inplace(finalSum032, bias1);
+    add_inplace(finalSum3264, bias2);
 
     if (timing) {
         print_duration(start, "Block " + to_string(layer) + " - convbnDx" + to_string(n));
@@ -1185,13 +2449,21 @@ Ctxt FHEController::downsample1024to256(const Ctxt &c1, const Ctxt &c2) {
      */
     Ctxt fullpack = add(mult(c1, mask_first_n(16384, c1->GetLevel())), mult(c2, mask_second_n(16384, c2->GetLevel())));
 
+    return downsample1024to256(fullpack);
+}
+
+Ctxt FHEController::downsample1024to256(const Ctxt &in) {
+    num_slots = 16384*2;
+
+    Ctxt fullpack = in;
+
     /*
      * We first juxtapose the values in the rows
      */
-    fullpack = context->EvalMult(context->EvalAdd(fullpack, context->EvalRotate(fullpack, 1)), gen_mask(2, fullpack->GetLevel()));
-    fullpack = context->EvalMult(context->EvalAdd(fullpack, context->EvalRotate(context->EvalRotate(fullpack, 1), 1)), gen_mask(4, fullpack->GetLevel()));
-    fullpack = context->EvalMult(context->EvalAdd(fullpack, context->EvalRotate(fullpack, 4)), gen_mask(8, fullpack->GetLevel()));
-    fullpack = context->EvalAdd(fullpack, context->EvalRotate(fullpack, 8));
+    fullpack = mult(add(fullpack, rotate(fullpack, 1)), gen_mask(2, fullpack->GetLevel()));
+    fullpack = mult(add(fullpack, rotate(fullpack, 2)), gen_mask(4, fullpack->GetLevel()));
+    fullpack = mult(add(fullpack, rotate(fullpack, 4)), gen_mask(8, fullpack->GetLevel()));
+    add_inplace(fullpack, rotate(fullpack, 8));
 
     Ctxt downsampledrows = encrypt({0});
 
@@ -1200,10 +2472,10 @@ Ctxt FHEController::downsample1024to256(const Ctxt &c1, const Ctxt &c2) {
      * Then, the rows themselves (this method is a little bit slower, but requires one Automorphism Key)
      */
     for (int i = 0; i < 16; i++) {
-        Ctxt masked = context->EvalMult(fullpack, mask_first_n_mod(16, 1024, i, fullpack->GetLevel()));
-        downsampledrows = context->EvalAdd(downsampledrows, masked);
+        Ctxt masked = mult(fullpack, mask_first_n_mod(16, 1024, i, fullpack->GetLevel()));
+        add_inplace(downsampledrows, masked);
         if (i < 15) {
-            fullpack = context->EvalRotate(fullpack, 64 - 16); //Si può fare fast
+            fullpack = rotate(fullpack, 64 - 16); //Si può fare fast
         }
     }
 
@@ -1212,14 +2484,14 @@ Ctxt FHEController::downsample1024to256(const Ctxt &c1, const Ctxt &c2) {
      */
     Ctxt downsampledchannels = encrypt({0});
     for (int i = 0; i < 32; i++) {
-        Ctxt masked = context->EvalMult(downsampledrows, mask_channel(i, downsampledrows->GetLevel()));
-        downsampledchannels = context->EvalAdd(downsampledchannels, masked);
-        downsampledchannels = context->EvalRotate(downsampledchannels, -(1024 - 256));
+        Ctxt masked = mult(downsampledrows, mask_channel(i, downsampledrows->GetLevel()));
+        add_inplace(downsampledchannels, masked);
+        downsampledchannels = rotate(downsampledchannels, -(1024 - 256));
     }
 
-    downsampledchannels = context->EvalRotate(downsampledchannels, (1024 - 256) * 32);
-    downsampledchannels = context->EvalAdd(downsampledchannels, context->EvalRotate(downsampledchannels, -8192));
-    downsampledchannels = context->EvalAdd(downsampledchannels, context->EvalRotate(context->EvalRotate(downsampledchannels, -8192), -8192));
+    downsampledchannels = rotate(downsampledchannels, (1024 - 256) * 32);
+    add_inplace(downsampledchannels, rotate(downsampledchannels, -8192));
+    add_inplace(downsampledchannels, rotate(downsampledchannels, -16384));
 
     downsampledchannels->SetSlots(8192);
 
@@ -1234,18 +2506,26 @@ Ctxt FHEController::downsample256to64(const Ctxt &c1, const Ctxt &c2) {
     num_slots = 8192*2;
     Ctxt fullpack = add(mult(c1, mask_first_n(8192, c1->GetLevel())), mult(c2, mask_second_n(8192, c2->GetLevel())));
 
+    return downsample256to64(fullpack);
+}
+
+Ctxt FHEController::downsample256to64(const Ctxt &in) {
+    num_slots = 8192*2;
+
+    Ctxt fullpack = in;
+
     //Affianco tutte le righe
-    fullpack = context->EvalMult(context->EvalAdd(fullpack, context->EvalRotate(fullpack, 1)), gen_mask(2, fullpack->GetLevel()));
-    fullpack = context->EvalMult(context->EvalAdd(fullpack, context->EvalRotate(context->EvalRotate(fullpack, 1), 1)), gen_mask(4, fullpack->GetLevel()));
-    fullpack = context->EvalAdd(fullpack, context->EvalRotate(fullpack, 4));
+    fullpack = mult(add(fullpack, rotate(fullpack, 1)), gen_mask(2, fullpack->GetLevel()));
+    fullpack = mult(add(fullpack, rotate(fullpack, 2)), gen_mask(4, fullpack->GetLevel()));
+    add_inplace(fullpack, rotate(fullpack, 4));
 
     Ctxt downsampledrows = encrypt({0});
 
     for (int i = 0; i < 32; i++) {
-        Ctxt masked = context->EvalMult(fullpack, mask_first_n_mod2(8, 256, i, fullpack->GetLevel()));
-        downsampledrows = context->EvalAdd(downsampledrows, masked);
+        Ctxt masked = mult(fullpack, mask_first_n_mod2(8, 256, i, fullpack->GetLevel()));
+        add_inplace(downsampledrows, masked);
         if (i < 31) {
-            fullpack = context->EvalRotate(fullpack, 32 - 8);
+            fullpack = rotate(fullpack, 32 - 8);
         }
     }
 
@@ -1256,18 +2536,18 @@ Ctxt FHEController::downsample256to64(const Ctxt &c1, const Ctxt &c2) {
     Ctxt downsampledchannels = encrypt({0});
     for (int i = 0; i < 64; i++) {
         //N.B. se ruoto downsampledrows posso farle fast
-        Ctxt masked = context->EvalMult(downsampledrows, mask_channel_2(i, downsampledrows->GetLevel()));
-        downsampledchannels = context->EvalAdd(downsampledchannels, masked);
-        downsampledchannels = context->EvalRotate(downsampledchannels, -(256 - 64));
+        Ctxt masked = mult(downsampledrows, mask_channel_2(i, downsampledrows->GetLevel()));
+        add_inplace(downsampledchannels, masked);
+        downsampledchannels = rotate(downsampledchannels, -(256 - 64));
     }
 
     //Qua e giusto....
     //print(downsampledchannels, 16384);
     //exit(1);
 
-    downsampledchannels = context->EvalRotate(downsampledchannels, (256 - 64) * 64);
-    downsampledchannels = context->EvalAdd(downsampledchannels, context->EvalRotate(downsampledchannels, -4096));
-    downsampledchannels = context->EvalAdd(downsampledchannels, context->EvalRotate(context->EvalRotate(downsampledchannels, -4096), -4096));
+    downsampledchannels = rotate(downsampledchannels, (256 - 64) * 64);
+    add_inplace(downsampledchannels, rotate(downsampledchannels, -4096));
+    add_inplace(downsampledchannels, rotate(downsampledchannels, -8192));
 
     downsampledchannels->SetSlots(4096);
 
@@ -1279,7 +2559,7 @@ Ctxt FHEController::rotsum(const Ctxt &in, int slots) {
     Ctxt result = in->Clone();
 
     for (int i = 0; i < log2(slots); i++) {
-        result = add(result, context->EvalRotate(result, pow(2, i)));
+        add_inplace(result, rotate(result, pow(2, i)));
     }
 
     return result;
@@ -1289,14 +2569,119 @@ Ctxt FHEController::rotsum_padded(const Ctxt &in, int slots) {
     Ctxt result = in->Clone();
 
     for (int i = 0; i < log2(slots); i++) {
-        result = add(result, context->EvalRotate(result, slots * pow(2, i)));
+        add_inplace(result, rotate(result, slots * pow(2, i)));
     }
 
     return result;
 }
 
 Ctxt FHEController::repeat(const Ctxt &in, int slots) {
-    return context->EvalRotate(rotsum(in, slots), -slots + 1);
+    return rotate(rotsum(in, slots), -slots + 1);
+}
+
+Ctxt FHEController::avgpool_fc(const Ctxt &in, bool timing) {
+    auto start = start_time();
+
+    /*
+     * Global average pooling + fully connected layer as a single linear map M (4096 -> 10), where
+     * out[i] = sum_j x[j] * fc[j / 64][i] / 64. Slot j of u = sum_{s<16} rot(x, s) * B_s collects the
+     * terms x[j + s] * M[j % 16][j + s], so out[i] is the sum of u over the slots congruent to i mod 16.
+     * The 16 diagonals are evaluated with BSGS: hoisted baby steps {1, 2, 3} and Horner giant steps by 4.
+     */
+    int slots = 4096;
+    int channels = 64;
+    int classes = 10;
+    int baby_steps = 4;
+    int giant_steps = 4;
+    int diagonals = baby_steps * giant_steps;
+
+    vector<double> weight = read_values_from_file("../weights/fc.bin");
+
+    auto fc_entry = [&](int i, int j) -> double {
+        if (i >= classes) return 0;
+        return weight[(classes * ((j % slots) / (slots / channels))) + i] / (slots / channels);
+    };
+
+    auto digits = fast_rotation_precompute(in);
+
+    vector<Ctxt> baby_rotations;
+    baby_rotations.push_back(in);
+    for (int b = 1; b < baby_steps; b++) {
+        baby_rotations.push_back(fast_rotate(in, b, digits));
+    }
+
+    Ctxt res;
+
+    for (int a = giant_steps - 1; a >= 0; a--) {
+        vector<Ctxt> inner;
+
+        for (int b = 0; b < baby_steps; b++) {
+            int s = baby_steps * a + b;
+
+            //Diagonal B_s, pre-rotated by -baby_steps * a so that it aligns after the giant step
+            vector<double> diagonal(slots);
+            for (int j = 0; j < slots; j++) {
+                int k = (j - baby_steps * a + slots) % slots;
+                diagonal[j] = fc_entry(k % diagonals, k + s);
+            }
+
+            inner.push_back(mult(baby_rotations[b], encode(diagonal, in->GetLevel(), slots)));
+        }
+
+        if (a == giant_steps - 1) {
+            res = add_many(inner);
+        } else {
+            res = add(rotate(res, baby_steps), add_many(inner));
+        }
+    }
+
+    //Summing the slots congruent mod 16, the i-th class ends up in slot i
+    for (int i = diagonals; i < slots; i *= 2) {
+        add_inplace(res, rotate(res, i));
+    }
+
+    if (timing) {
+        print_duration(start, "Average pooling + fully connected");
+    }
+
+    return res;
+}
+
+/*
+ * Full-slot packing: the input (e.g. 16 channels in 16384 slots) is read as 32768 slots, where it is replicated
+ * twice, and both output groups (e.g. channels 0-15 and 16-31) are computed at once, the first group in the
+ * first half and the second group in the second half. This halves multiplications and rotations, and the result
+ * is already the "fullpack" ciphertext expected by the downsampling, which saves its first masking level.
+ *
+ * With the accumulation of convbn (rotating by one channel at each step), block idx of the j-th weight vector
+ * must contain the j-th diagonal of the first group if idx < j or idx >= channels + j, of the second group
+ * otherwise.
+ */
+Ptxt FHEController::fullslot_weight(const string &prefix, int j, int k, int channels, double scale, int level) {
+    if (dry_run) {
+        return encode(vector<double>(), level, 2 * num_slots);
+    }
+
+    vector<double> values = fullslot_values(prefix, j, k, channels, scale);
+    return encode(values, level, static_cast<int>(values.size()));
+}
+
+vector<double> FHEController::fullslot_values(const string &prefix, int j, int k, int channels, double scale) {
+    vector<double> values1 = read_values_from_file(prefix + "-ch" + to_string(j) + "-k" + to_string(k) + ".bin", scale);
+    vector<double> values2 = read_values_from_file(prefix + "-ch" + to_string(j + channels) + "-k" + to_string(k) + ".bin", scale);
+
+    int channel_size = static_cast<int>(values1.size()) / channels;
+
+    vector<double> values;
+    values.reserve(2 * values1.size());
+
+    for (int idx = 0; idx < 2 * channels; idx++) {
+        const vector<double>& group = (idx < j || idx >= channels + j) ? values1 : values2;
+        int block = idx % channels;
+        values.insert(values.end(), group.begin() + block * channel_size, group.begin() + (block + 1) * channel_size);
+    }
+
+    return values;
 }
 
 Ctxt FHEController::convbn1632sxV2(const Ctxt &in, int layer, int n, double scale, bool timing) {
@@ -1309,65 +2694,61 @@ Ctxt FHEController::convbn1632sxV2(const Ctxt &in, int layer, int n, double scal
 
     in->SetSlots(16384 * 2);
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    auto digits = fast_rotation_precompute(in);
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -(img_width), context->GetCyclotomicOrder(), digits), -padding));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -(img_width), context->GetCyclotomicOrder(), digits), padding));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
-    c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), padding));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
+    c_rotations.push_back(in->Clone());
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, (img_width), context->GetCyclotomicOrder(), digits), -padding));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, (img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, (img_width), context->GetCyclotomicOrder(), digits), padding));
+            rotate(fast_rotate(in, (img_width), digits), padding));
 
-    vector<Ctxt> applied_filters16;
-    vector<Ctxt> applied_filters32;
+    //The input is shared with convbn1632dxV2, so I restore its slots
+    in->SetSlots(16384);
+
+    string prefix = "../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n);
 
-    vector<double> bias1_v = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-bias1.bin", scale);
-    vector<double> bias2_v = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-bias2.bin", scale);
+    vector<double> bias1_v = read_values_from_file(prefix + "-bias1.bin", scale);
+    vector<double> bias2_v = read_values_from_file(prefix + "-bias2.bin", scale);
 
     bias1_v.insert(bias1_v.end(), bias2_v.begin(), bias2_v.end());
 
-    Ptxt bias1 = encode(bias1_v, circuit_depth - 10, 16384 * 2);
+    Ptxt bias = encode(bias1_v, in->GetLevel(), 16384 * 2);
 
     Ctxt finalSum;
 
-    for (int j = 0; j < 16; j++) {
-        vector<Ctxt> k_rows;
-
-        for (int k = 0; k < 9; k++) {
-            vector<double> values1 = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                          to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            vector<double> values2 = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                            to_string(j+16) + "-k" + to_string(k+1) + ".bin", scale);
-
-            values1.insert(values1.end(), values2.begin(), values2.end());
+    vector<Ctxt> sums;
 
-            k_rows.push_back(context->EvalMult(c_rotations[k], encode(values1, circuit_depth - 10, 16384*2)));
+    for (int j = 0; j < 16; j++) {
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(MAC_TILE, [&](int c, int k) {
+                return fullslot_values(prefix, j + c, k + 1, 16, scale);
+            }, in->GetLevel(), 16384 * 2));
         }
 
-        Ctxt sum = context->EvalAddMany(k_rows);
+        Ctxt sum = sums[j % MAC_TILE];
 
         if (j == 0) {
             finalSum = sum->Clone();
-            finalSum = context->EvalRotate(finalSum, -1024);
+            finalSum = rotate(finalSum, -1024);
         } else {
-            finalSum = context->EvalAdd(finalSum, sum);
-            finalSum = context->EvalRotate(finalSum, -1024);
+            add_inplace(finalSum, sum);
+            finalSum = rotate(finalSum, -1024);
         }
 
     }
 
-    finalSum = context->EvalRotate(finalSum, 16384);
-    finalSum = context->EvalAdd(finalSum, bias1);
+    add_inplace(finalSum, bias);
 
     if (timing) {
-        print_duration(start, "Block " + to_string(layer) + " - convbn" + to_string(n));
+        print_duration(start, "Block " + to_string(layer) + " - convbnSx" + to_string(n) + " (full-slot)");
     }
 
     return finalSum;
@@ -1376,283 +2757,510 @@ Ctxt FHEController::convbn1632sxV2(const Ctxt &in, int layer, int n, double scal
 Ctxt FHEController::convbn1632dxV2(const Ctxt &in, int layer, int n, double scale, bool timing) {
     auto start = start_time();
 
-    in->SetSlots(16384 * 2);
+    Ctxt in_full = in->Clone();
+    in_full->SetSlots(16384 * 2);
+
+    string prefix = "../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n);
 
-    vector<double> bias1_v = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-bias1.bin", scale);
-    vector<double> bias2_v = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-bias2.bin", scale);
+    vector<double> bias1_v = read_values_from_file(prefix + "-bias1.bin", scale);
+    vector<double> bias2_v = read_values_from_file(prefix + "-bias2.bin", scale);
 
     bias1_v.insert(bias1_v.end(), bias2_v.begin(), bias2_v.end());
 
-    Ptxt bias = encode(bias1_v, circuit_depth - 10, 16384 * 2);
+    Ptxt bias = encode(bias1_v, in->GetLevel(), 16384 * 2);
 
     Ctxt finalSum;
 
     for (int j = 0; j < 16; j++) {
-        Ctxt k_row;
-
-        vector<double> values1 = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                       to_string(j) + "-k1.bin", scale);
-        vector<double> values2 = read_values_from_file("../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                       to_string(j+16) + "-k1.bin", scale);
-
-        values1.insert(values1.end(), values2.begin(), values2.end());
-
-        k_row = context->EvalMult(in, encode(values1, circuit_depth - 10, 16384*2));
-
-        Ctxt sum = k_row;
+        Ctxt sum = mult(in_full, fullslot_weight(prefix, j, 1, 16, scale, in->GetLevel()));
 
         if (j == 0) {
             finalSum = sum->Clone();
-            finalSum = context->EvalRotate(finalSum, -1024);
+            finalSum = rotate(finalSum, -1024);
         } else {
-            finalSum = context->EvalAdd(finalSum, sum);
-            finalSum = context->EvalRotate(finalSum, -1024);
+            add_inplace(finalSum, sum);
+            finalSum = rotate(finalSum, -1024);
         }
 
     }
 
-    finalSum = context->EvalRotate(finalSum, 16384);
-    finalSum = context->EvalAdd(finalSum, bias);
+    add_inplace(finalSum, bias);
 
     if (timing) {
-        print_duration(start, "Block " + to_string(layer) + " - convbn" + to_string(n));
+        print_duration(start, "Block " + to_string(layer) + " - convbnDx" + to_string(n) + " (full-slot)");
     }
 
     return finalSum;
 }
 
-Ctxt FHEController::convbnV2(const Ctxt &in, int layer, int n, double scale, bool timing) {
+Ctxt FHEController::convbn3264sxV2(const Ctxt &in, int layer, int n, double scale, bool timing) {
     auto start = start_time();
 
     vector<Ctxt> c_rotations;
 
-    int img_width = 32;
+    int img_width = 16;
     int padding = 1;
 
-    auto digits = context->EvalFastRotationPrecompute(in);
+    in->SetSlots(8192 * 2);
+
+    auto digits = fast_rotation_precompute(in);
 
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, -img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), -img_width ));
-    c_rotations.push_back(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits));
-    c_rotations.push_back(in);
-    c_rotations.push_back(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, -(img_width), digits), padding));
+    c_rotations.push_back(fast_rotate(in, -padding, digits));
+    c_rotations.push_back(in->Clone());
+    c_rotations.push_back(fast_rotate(in, padding, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, -padding, context->GetCyclotomicOrder(), digits), img_width));
-    c_rotations.push_back(context->EvalFastRotation(in, img_width, context->GetCyclotomicOrder(), digits));
+            rotate(fast_rotate(in, (img_width), digits), -padding));
+    c_rotations.push_back(fast_rotate(in, img_width, digits));
     c_rotations.push_back(
-            context->EvalRotate(context->EvalFastRotation(in, padding, context->GetCyclotomicOrder(), digits), img_width ));
+            rotate(fast_rotate(in, (img_width), digits), padding));
 
-    Ptxt bias = encode(read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-bias.bin", scale), in->GetLevel(), 8192);
+    //The input is shared with convbn3264dxV2, so I restore its slots
+    in->SetSlots(8192);
 
-    Ctxt finalsum;
+    string prefix = "../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n);
 
-    for (int j = 0; j < 8; j++) {
-        vector<Ctxt> k_rows;
+    vector<double> bias1_v = read_values_from_file(prefix + "-bias1.bin", scale);
+    vector<double> bias2_v = read_values_from_file(prefix + "-bias2.bin", scale);
 
-        for (int k = 0; k < 9; k++) {
-            vector<double> values1 = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                          to_string(j) + "-k" + to_string(k+1) + ".bin", scale);
-            vector<double> values2 = read_values_from_file("../weights/layer" + to_string(layer) + "-conv" + to_string(n) + "bn" + to_string(n) + "-ch" +
-                                                           to_string(j+8) + "-k" + to_string(k+1) + ".bin", scale);
+    bias1_v.insert(bias1_v.end(), bias2_v.begin(), bias2_v.end());
 
-            values1.insert(values1.end(), values2.begin(), values2.end());
+    Ptxt bias = encode(bias1_v, in->GetLevel(), 8192 * 2);
 
-            Ptxt encoded = encode(values1, circuit_depth - 3, 32768);
-            c_rotations[k]->SetSlots(32768);
-            k_rows.push_back(context->EvalMult(c_rotations[k], encoded));
+    Ctxt finalSum;
+
+    vector<Ctxt> sums;
+
+    for (int j = 0; j < 32; j++) {
+        if (j % MAC_TILE == 0) {
+            sums = mac_taps(c_rotations, encode_taps(MAC_TILE, [&](int c, int k) {
+                return fullslot_values(prefix, j + c, k + 1, 32, scale);
+            }, in->GetLevel(), 8192 * 2));
         }
 
-        Ctxt sum = context->EvalAddMany(k_rows);
+        Ctxt sum = sums[j % MAC_TILE];
+
         if (j == 0) {
-            finalsum = sum->Clone();
-            finalsum = context->EvalRotate(finalsum, -1024);
+            finalSum = sum->Clone();
+            finalSum = rotate(finalSum, -256);
         } else {
-            finalsum = context->EvalAdd(finalsum, sum);
-            finalsum = context->EvalRotate(finalsum, -1024);
+            add_inplace(finalSum, sum);
+            finalSum = rotate(finalSum, -256);
         }
 
     }
 
-    finalsum = context->EvalAdd(finalsum, context->EvalRotate(finalsum, 16384));
-    finalsum->SetSlots(16384);
-
-    finalsum = context->EvalAdd(finalsum, bias);
+    add_inplace(finalSum, bias);
 
     if (timing) {
-        print_duration(start, "  Layer" + to_string(layer) + " - convbn" + to_string(n));
+        print_duration(start, "Block " + to_string(layer) + " - convbnSx" + to_string(n) + " (full-slot)");
     }
 
-    return finalsum;
+    return finalSum;
 }
 
-Ptxt FHEController::gen_mask(int n, int level) {
-    vector<double> mask;
+Ctxt FHEController::convbn3264dxV2(const Ctxt &in, int layer, int n, double scale, bool timing) {
+    auto start = start_time();
 
-    int copy_interval = n;
+    Ctxt in_full = in->Clone();
+    in_full->SetSlots(8192 * 2);
 
-    for (int i = 0; i < num_slots; i++) {
-        if (copy_interval > 0) {
-            mask.push_back(1);
+    string prefix = "../weights/layer" + to_string(layer) + "dx-conv" + to_string(n) + "bn" + to_string(n);
+
+    vector<double> bias1_v = read_values_from_file(prefix + "-bias1.bin", scale);
+    vector<double> bias2_v = read_values_from_file(prefix + "-bias2.bin", scale);
+
+    bias1_v.insert(bias1_v.end(), bias2_v.begin(), bias2_v.end());
+
+    Ptxt bias = encode(bias1_v, in->GetLevel(), 8192 * 2);
+
+    Ctxt finalSum;
+
+    for (int j = 0; j < 32; j++) {
+        Ctxt sum = mult(in_full, fullslot_weight(prefix, j, 1, 32, scale, in->GetLevel()));
+
+        if (j == 0) {
+            finalSum = sum->Clone();
+            finalSum = rotate(finalSum, -256);
         } else {
-            mask.push_back(0);
+            add_inplace(finalSum, sum);
+            finalSum = rotate(finalSum, -256);
         }
 
-        copy_interval--;
+    }
+
+    add_inplace(finalSum, bias);
 
-        if (copy_interval <= -n) {
-            copy_interval = n;
-        }
+    if (timing) {
+        print_duration(start, "Block " + to_string(layer) + " - convbnDx" + to_string(n) + " (full-slot)");
     }
 
-    return encode(mask, level, num_slots);
+    return finalSum;
 }
 
-Ptxt FHEController::mask_first_n(int n, int level) {
-    vector<double> mask;
+//Doubles are written in hexadecimal in the keys, so that different values never share a mask
+static string exact_key(double d) {
+    ostringstream key;
+    key << hexfloat << d;
+    return key.str();
+}
 
-    for (int i = 0; i < num_slots; i++) {
-        if (i < n) {
-            mask.push_back(1);
-        } else {
-            mask.push_back(0);
-        }
+Ptxt FHEController::cached_mask(const string& key, int level, int plaintext_num_slots, const std::function<vector<double>()>& build) {
+    if (!use_mask_cache || dry_run) {
+        return encode(build(), level, plaintext_num_slots);
     }
 
-    return encode(mask, level, num_slots);
+    string full_key = key + "/" + to_string(level) + "/" + to_string(plaintext_num_slots);
+
+    auto cached = mask_cache.find(full_key);
+    if (cached != mask_cache.end()) {
+        return cached->second;
+    }
+
+    Ptxt mask = encode(build(), level, plaintext_num_slots);
+
+    //Most masks are used once per phase (e.g. the 32 mask_channel of a downsampling), only repeated ones are kept
+    if (++mask_requests[full_key] < 2) {
+        return mask;
+    }
+
+    mask_cache[full_key] = mask;
+
+    if (memory.running()) {
+        memory.add_bytes("cached plaintexts", plaintext_bytes(mask));
+    }
+
+    return mask;
 }
 
-Ptxt FHEController::mask_second_n(int n, int level) {
-    vector<double> mask;
+void FHEController::clear_mask_cache() {
+    mask_cache.clear();
+    mask_requests.clear();
 
-    for (int i = 0; i < num_slots; i++) {
-        if (i >= n) {
-            mask.push_back(1);
-        } else {
-            mask.push_back(0);
-        }
+    if (memory.running()) {
+        memory.set_bytes("cached plaintexts", 0);
     }
+}
+
+Ptxt FHEController::gen_mask(int n, int level) {
+    return cached_mask("gen_mask/" + to_string(n), level, num_slots, [this, n]() {
+        vector<double> mask;
+
+        int copy_interval = n;
+
+        for (int i = 0; i < num_slots; i++) {
+            if (copy_interval > 0) {
+                mask.push_back(1);
+            } else {
+                mask.push_back(0);
+            }
+
+            copy_interval--;
+
+            if (copy_interval <= -n) {
+                copy_interval = n;
+            }
+        }
 
-    return encode(mask, level, num_slots);
+        return mask;
+    });
 }
 
-Ptxt FHEController::mask_first_n_mod(int n, int padding, int pos, int level) {
-    vector<double> mask;
-    for (int i = 0; i < 32; i++) {
-        for (int j = 0; j < (pos * n); j++) {
-            mask.push_back(0);
+Ptxt FHEController::mask_first_n(int n, int level) {
+    return cached_mask("mask_first_n/" + to_string(n), level, num_slots, [this, n]() {
+        vector<double> mask;
+
+        for (int i = 0; i < num_slots; i++) {
+            if (i < n) {
+                mask.push_back(1);
+            } else {
+                mask.push_back(0);
+            }
         }
-        for (int j = 0; j < n; j++) {
-            mask.push_back(1);
+
+        return mask;
+    });
+}
+
+Ptxt FHEController::mask_second_n(int n, int level) {
+    return cached_mask("mask_second_n/" + to_string(n), level, num_slots, [this, n]() {
+        vector<double> mask;
+
+        for (int i = 0; i < num_slots; i++) {
+            if (i >= n) {
+                mask.push_back(1);
+            } else {
+                mask.push_back(0);
+            }
         }
-        for (int j = 0; j < (padding - n - (pos * n)); j++) {
-            mask.push_back(0);
+
+        return mask;
+    });
+}
+
+Ptxt FHEController::mask_first_n_mod(int n, int padding, int pos, int level) {
+    return cached_mask("mask_first_n_mod/" + to_string(n) + "/" + to_string(padding) + "/" + to_string(pos), level, 16384 * 2, [n, padding, pos]() {
+        vector<double> mask;
+        for (int i = 0; i < 32; i++) {
+            for (int j = 0; j < (pos * n); j++) {
+                mask.push_back(0);
+            }
+            for (int j = 0; j < n; j++) {
+                mask.push_back(1);
+            }
+            for (int j = 0; j < (padding - n - (pos * n)); j++) {
+                mask.push_back(0);
+            }
         }
-    }
 
-    return encode(mask, level, 16384 * 2);
+        return mask;
+    });
 }
 
 Ptxt FHEController::mask_first_n_mod2(int n, int padding, int pos, int level) {
-    vector<double> mask;
-    for (int i = 0; i < 64; i++) {
-        for (int j = 0; j < (pos * n); j++) {
-            mask.push_back(0);
+    return cached_mask("mask_first_n_mod2/" + to_string(n) + "/" + to_string(padding) + "/" + to_string(pos), level, 8192 * 2, [n, padding, pos]() {
+        vector<double> mask;
+        for (int i = 0; i < 64; i++) {
+            for (int j = 0; j < (pos * n); j++) {
+                mask.push_back(0);
+            }
+            for (int j = 0; j < n; j++) {
+                mask.push_back(1);
+            }
+            for (int j = 0; j < (padding - n - (pos * n)); j++) {
+                mask.push_back(0);
+            }
+        }
+
+        return mask;
+    });
+}
+
+Ptxt FHEController::mask_channel(int n, int level) {
+    return cached_mask("mask_channel/" + to_string(n), level, 16384 * 2, [n]() {
+        vector<double> mask;
+
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < 1024; j++) {
+                mask.push_back(0);
+            }
         }
-        for (int j = 0; j < n; j++) {
+
+        for (int i = 0; i < 256; i++) {
             mask.push_back(1);
         }
-        for (int j = 0; j < (padding - n - (pos * n)); j++) {
+
+        for (int i = 0; i < 1024 - 256; i++) {
             mask.push_back(0);
         }
-    }
 
-    return encode(mask, level, 8192 * 2);
+        for (int i = 0; i < 31 - n; i++) {
+            for (int j = 0; j < 1024; j++) {
+                mask.push_back(0);
+            }
+        }
+
+        return mask;
+    });
 }
 
-Ptxt FHEController::mask_channel(int n, int level) {
-    vector<double> mask;
+Ptxt FHEController::mask_channel_2(int n, int level) {
+    return cached_mask("mask_channel_2/" + to_string(n), level, 8192 * 2, [n]() {
+        vector<double> mask;
 
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < 1024; j++) {
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < 256; j++) {
+                mask.push_back(0);
+            }
+        }
+
+        for (int i = 0; i < 64; i++) {
+            mask.push_back(1);
+        }
+
+        for (int i = 0; i < 256 - 64; i++) {
             mask.push_back(0);
         }
-    }
 
-    for (int i = 0; i < 256; i++) {
-        mask.push_back(1);
-    }
+        for (int i = 0; i < 63 - n; i++) {
+            for (int j = 0; j < 256; j++) {
+                mask.push_back(0);
+            }
+        }
 
-    for (int i = 0; i < 1024 - 256; i++) {
-        mask.push_back(0);
-    }
+        return mask;
+    });
+}
 
-    for (int i = 0; i < 31 - n; i++) {
-        for (int j = 0; j < 1024; j++) {
-            mask.push_back(0);
+Ptxt FHEController::mask_mod(int n, int level, double custom_val) {
+    return cached_mask("mask_mod/" + to_string(n) + "/" + exact_key(custom_val), level, num_slots, [this, n, custom_val]() {
+        vector<double> vec;
+
+        for (int i = 0; i < num_slots; i++) {
+            if (i % n == 0) {
+                vec.push_back(custom_val);
+            } else {
+                vec.push_back(0);
+            }
         }
-    }
 
-    return encode(mask, level, 16384 * 2);
+        return vec;
+    });
 }
 
-Ptxt FHEController::mask_channel_2(int n, int level) {
-    vector<double> mask;
+Ptxt FHEController::mask_from_to(int from, int to, int level) {
+    return cached_mask("mask_from_to/" + to_string(from) + "/" + to_string(to), level, num_slots, [this, from, to]() {
+        vector<double> vec;
+
+        for (int i = 0; i < num_slots; i++) {
+            if (i >= from && i < to) {
+                vec.push_back(1);
+            } else {
+                vec.push_back(0);
+            }
+        }
 
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < 256; j++) {
-            mask.push_back(0);
+        return vec;
+    });
+}
+
+string FHEController::bootstrap_policy_filename() const {
+    return "../" + parameters_folder + "/bootstrap-policy.txt";
+}
+
+string FHEController::bootstrap_keys_filename() const {
+    return "../" + parameters_folder + "/bootstrap-keys.txt";
+}
+
+void FHEController::check_bootstrap_keys() const {
+    //One line per number of slots: "S CTOS STOC", folders generated before it have the budget of the context
+    map<int, vector<uint32_t>> generated;
+
+    ifstream file(bootstrap_keys_filename());
+    int slots;
+    uint32_t cts, stc;
+    while (file >> slots >> cts >> stc) {
+        generated[slots] = {cts, stc};
+    }
+
+    set<int> all_slots;
+    for (const auto& [s, budget] : generated) all_slots.insert(s);
+    for (const auto& [s, budget] : slot_level_budget) all_slots.insert(s);
+
+    for (int s : all_slots) {
+        vector<uint32_t> keys = generated.count(s) ? generated.at(s) : level_budget;
+        vector<uint32_t> policy = level_budget_for(s);
+
+        if (keys != policy) {
+            cerr << "The bootstrapping keys of " << s << " slots have level budget " << keys[0] << ", " << keys[1]
+                 << " but " << bootstrap_policy_filename() << " sets " << policy[0] << ", " << policy[1]
+                 << ": generate the keys again with generate_keys" << endl;
+            exit(1);
         }
     }
+}
 
-    for (int i = 0; i < 64; i++) {
-        mask.push_back(1);
+string FHEController::bootstrap_site() {
+    //The N-th bootstrapping of the current block, counted again when the block changes
+    string scope = tracer.current_scope();
+    if (scope != site_scope) {
+        site_scope = scope;
+        site_ordinal = 0;
     }
 
-    for (int i = 0; i < 256 - 64; i++) {
-        mask.push_back(0);
+    return scope + "#" + to_string(++site_ordinal);
+}
+
+vector<uint32_t> FHEController::level_budget_for(int bootstrap_slots) const {
+    auto budget = slot_level_budget.find(bootstrap_slots);
+    return budget != slot_level_budget.end() ? budget->second : level_budget;
+}
+
+void FHEController::load_bootstrap_policy() {
+    slot_level_budget.clear();
+    site_policy.clear();
+
+    ifstream file(bootstrap_policy_filename());
+    if (!file.is_open()) {
+        return;
     }
 
-    for (int i = 0; i < 63 - n; i++) {
-        for (int j = 0; j < 256; j++) {
-            mask.push_back(0);
+    string line;
+    while (getline(file, line)) {
+        istringstream row(line);
+        string kind;
+        row >> kind;
+
+        if (kind == "slots") {
+            int slots;
+            uint32_t cts, stc;
+            if (!(row >> slots >> cts >> stc)) continue;
+
+            //A different depth would move the level of every bootstrapped ciphertext
+            if (cts + stc != level_budget[0] + level_budget[1]) {
+                cerr << "The level budget of " << slots << " slots must use " << level_budget[0] + level_budget[1]
+                     << " levels, as the one of the context" << endl;
+                exit(1);
+            }
+
+            slot_level_budget[slots] = {cts, stc};
+        } else if (kind == "site") {
+            BootstrapSite site;
+            string name;
+            if (!(row >> site.iterations >> site.precision)) continue;
+
+            getline(row >> ws, name);
+            site_policy[name] = site;
         }
     }
-
-    return encode(mask, level, 8192 * 2);
 }
 
-Ptxt FHEController::mask_mod(int n, int level, double custom_val) {
-    vector<double> vec;
+void FHEController::write_bootstrap_policy() {
+    ofstream file(bootstrap_policy_filename());
 
-    for (int i = 0; i < num_slots; i++) {
-        if (i % n == 0) {
-            vec.push_back(custom_val);
-        } else {
-            vec.push_back(0);
-        }
+    for (const auto& [slots, budget] : slot_level_budget) {
+        file << "slots " << slots << " " << budget[0] << " " << budget[1] << "\n";
     }
 
-    return encode(vec, level, num_slots);
-}
+    cout << endl << "Bootstrapping precision (required: " << bootstrap_required_bits << " bits):" << endl;
 
-Ptxt FHEController::mask_from_to(int from, int to, int level) {
-    vector<double> vec;
+    //Sites not run now (e.g. resumed layers) keep their policy
+    map<string, BootstrapSite> sites = site_policy;
+    for (const auto& [site, bits] : measured_site_bits) {
+        sites[site] = {bits < bootstrap_required_bits ? 2 : 1, static_cast<int>(bits)};
+        cout << site << ": " << bits << " bits, " << (sites[site].iterations > 1 ? "two iterations" : "single iteration");
 
-    for (int i = 0; i < num_slots; i++) {
-        if (i >= from && i < to) {
-            vec.push_back(1);
-        } else {
-            vec.push_back(0);
+        //The second iteration moves the output down, the block must still reach the next bootstrapping in time
+        auto end_level = site_end_level.find(site);
+        bool fits = end_level != site_end_level.end() && end_level->second + DOUBLE_BOOTSTRAP_LEVELS <= circuit_depth - 2;
+        if (sites[site].iterations > 1 && !fits) {
+            sites[site].iterations = 1;
+            cout << " do not fit in the levels before the next bootstrapping";
+            if (end_level != site_end_level.end()) cout << " (level " << end_level->second << " of " << circuit_depth - 2 << ")";
+            cout << ", single iteration";
         }
+        cout << endl;
+    }
+
+    for (const auto& [site, policy] : sites) {
+        file << "site " << policy.iterations << " " << policy.precision << " " << site << "\n";
     }
 
-    return encode(vec, level, num_slots);
+    if (!file) {
+        cerr << "Could not write the bootstrapping policy in \"" << bootstrap_policy_filename() << "\"" << endl;
+        exit(1);
+    }
+
+    cout << "Bootstrapping policy written in " << bootstrap_policy_filename() << endl;
 }
 
 void FHEController::bootstrap_precision(const Ctxt &c) {
+    if (dry_run) return;
+
     cout << "Computing boostrap precision..." << endl;
 
     Ptxt a = decrypt(c);
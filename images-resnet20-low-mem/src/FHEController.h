@@ -14,6 +14,21 @@
 #include <thread>
 
 #include "Utils.h"
+#include "RotationKeyStore.h"
+#include "SeedCompression.h"
+#include "RawContainer.h"
+#include "Tracer.h"
+#include "MemoryMonitor.h"
+#include "HugePages.h"
+#include "CostModel.h"
+#include "RotationPlanner.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <future>
+#include <set>
+#include <functional>
+#include <sstream>
 
 using namespace lbcrypto;
 using namespace std;
@@ -24,6 +39,15 @@ using namespace utils;
 using Ptxt = Plaintext;
 using Ctxt = Ciphertext<DCRTPoly>;
 
+/*
+ * A set of keys that are loaded together during the inference (e.g. "rotations-layer2.bin")
+ */
+struct KeyPhase {
+    string filename;
+    vector<int> rotations;
+    int bootstrap_slots;
+};
+
 class FHEController {
     CryptoContext<DCRTPoly> context;
 
@@ -39,6 +63,8 @@ public:
     void generate_context(bool serialize = false);
     void generate_context(int log_ring, int log_scale, int log_primes, int digits_hks, int cts_levels, int stc_levels, int relu_deg, bool serialize = false);
     void load_context(bool verbose = true);
+    //Only the parameters of the network (ReLU degree, levels, slots), without the context
+    void load_parameters(bool verbose = true);
     void test_context();
 
     /*
@@ -52,20 +78,84 @@ public:
                                                   const string& filename);
 
 
+    void generate_keys_pipeline(const vector<KeyPhase>& phases, bool verbose);
+
+    /*
+     * Key sets of the phases: the ones planned by the dry run (rotation-plan.txt in the parameters folder) when
+     * present, the default ones otherwise. Rotations without their own key are composed from the keys of the phase.
+     */
+    static vector<KeyPhase> default_key_phases();
+    vector<KeyPhase> planned_key_phases() const;
+    vector<KeyPhase> key_phases;
+
+    //Plans the key set of each phase from the rotations of the dry run, within a key memory budget (0: no limit)
+    void write_key_plan(double budget_mb);
+    void serialize_rotation_keys(const string& filename, const RotationKeyStore::KeyMap& keys);
+
+
     void load_bootstrapping_and_rotation_keys(const string& filename, int bootstrap_slots, bool verbose);
-    void load_rotation_keys(const string& filename, bool verbose);
+    void load_rotation_keys(const string& filename, bool verbose, const vector<int>& rotations = {});
+    void prefetch_rotation_keys(const string& filename);
     void clear_bootstrapping_and_rotation_keys(int bootstrap_num_slots);
     void clear_rotation_keys();
     void clear_context(int bootstrapping_key_slots);
 
+    //Returns the memory freed by the previous phase to the operating system
+    void release_memory();
+
+    /*
+     * Indexed key store: one record per automorphism key, shared between phases
+     */
+    void close_key_store();
+    bool use_key_store = false;
+
+    /*
+     * Seed-compressed keys and inputs: the uniform half of each pair is regenerated on load
+     */
+    void benchmark_seeded_keys(const string& filename);
+    bool use_seeded_keys = false;
+
+    /*
+     * Raw container format: page-aligned RNS limbs, adopted with one memcpy per limb
+     */
+    void save_checkpoint(const Ctxt& c, const string& name, int mults_needed);
+    Ctxt load_checkpoint(const string& name);
+    bool has_checkpoint(const string& name);
+    void wait_checkpoint();
+    bool use_raw_format = false;
+
+    /*
+     * Format of the serialized keys ("bin", "seeded", "raw" or "store"), recorded in key-format.txt when they are
+     * generated: keys are loaded only in this format, never from the files left by a previous generation
+     */
+    string key_format = "bin";
+
+    //Rotation keys are generated in the raw container by default (decoded in parallel), this writes the .bin files
+    bool use_binary_keys = false;
+
+    /*
+     * Key hosting: all the phases are loaded once before forking the workers, which share them read-only
+     */
+    void host_keys(const vector<string>& filenames, bool verbose);
+
+    /*
+     * Transparent huge pages for the evaluation keys (and the ciphertexts allocated next to them)
+     */
+    void benchmark_huge_pages(const string& filename);
+    bool use_huge_pages = false;
+
 
     /*
      * CKKS Encoding/Decoding/Encryption/Decryption
      */
     Ptxt encode(const vector<double>& vec, int level, int plaintext_num_slots);
     Ptxt encode(double val, int level, int plaintext_num_slots);
+    //Many vectors at the same level and slots, encoded in parallel (same result as encode)
+    vector<Ptxt> encode_many(const vector<vector<double>>& vecs, int level, int plaintext_num_slots);
     Ctxt encrypt(const vector<double>& vec, int level = 0, int plaintext_num_slots = 0);
     Ctxt encrypt_ptxt(const Ptxt& p);
+    void serialize_input_seeded(const vector<double>& vec, int level, const string& filename);
+    Ctxt deserialize_input_seeded(const string& filename);
     Ptxt decrypt(const Ctxt& c);
     vector<double> decrypt_tovector(const Ctxt& c, int slots);
 
@@ -74,11 +164,26 @@ public:
      * Homomorphic operations
      */
     Ctxt add(const Ctxt& c1, const Ctxt& c2);
+    Ctxt add(const Ctxt& c, const Ptxt& p);
+    Ctxt add_many(const vector<Ctxt>& c);
+    //Sum over the taps of taps[k] * weights[j][k], for each output channel j, in one pass over the RNS limbs
+    vector<Ctxt> mac_taps(const vector<Ctxt>& taps, const vector<vector<Ptxt>>& weights);
+    void add_inplace(Ctxt& c1, const Ctxt& c2);
+    void add_inplace(Ctxt& c, const Ptxt& p);
     Ctxt mult(const Ctxt& c, double d);
     Ctxt mult(const Ctxt& c, const Ptxt& p);
+    Ctxt rotate(const Ctxt& c, int index);
+    Ctxt fast_rotate(const Ctxt& c, int index, const std::shared_ptr<vector<DCRTPoly>>& digits);
+    std::shared_ptr<vector<DCRTPoly>> fast_rotation_precompute(const Ctxt& c);
+    Ctxt level_reduce(const Ctxt& c, int mults_needed);
+    //Drops a residual, as soon as it is stored, to the level of the ciphertext the last residual was added to
+    Ctxt hold_residual(const Ctxt& c);
+    //Adds a held residual to c, recording the level of c as the target of the next hold_residual with these slots
+    void add_residual(Ctxt& c, const Ctxt& residual);
     Ctxt bootstrap(const Ctxt& c, bool timing = false);
     Ctxt bootstrap(const Ctxt& c, int precision, bool timing = false);
-    Ctxt relu(const Ctxt& c, double scale, bool timing = false);
+    //The output is multiplied by output_scale, for free in the polynomial coefficients
+    Ctxt relu(const Ctxt& c, double scale, bool timing = false, double output_scale = 1);
     Ctxt relu_wide(const Ctxt& c, double a, double b, int degree, double scale, bool timing = false);
 
     /*
@@ -93,26 +198,34 @@ public:
      * Convolutional Neural Network functions
      */
     Ctxt convbn_initial(const Ctxt &in, double scale = 0.5, bool timing = false);
-    Ctxt convbn(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
-    Ctxt convbn2(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
-    Ctxt convbn3(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
+    //input_scale is the factor the input already carries (e.g. from relu's output_scale), removed from the weights
+    Ctxt convbn(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false, double input_scale = 1);
+    Ctxt convbn2(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false, double input_scale = 1);
+    Ctxt convbn3(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false, double input_scale = 1);
     vector<Ctxt> convbn1632sx(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
     vector<Ctxt> convbn1632dx(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
     vector<Ctxt> convbn3264sx(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
     vector<Ctxt> convbn3264dx(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
 
     Ctxt downsample1024to256(const Ctxt& c1, const Ctxt& c2);
+    Ctxt downsample1024to256(const Ctxt& in);
     Ctxt downsample256to64(const Ctxt &c1, const Ctxt &c2);
+    Ctxt downsample256to64(const Ctxt &in);
 
     Ctxt rotsum(const Ctxt &in, int slots);
     Ctxt rotsum_padded(const Ctxt &in, int slots);
 
     Ctxt repeat(const Ctxt &in, int slots);
 
-    //TODO: studia sta roba
-    Ctxt convbnV2(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
+    Ctxt avgpool_fc(const Ctxt &in, bool timing = false);
+
+    /*
+     * Full-slot (two channel groups in one ciphertext) versions of the downsampling blocks
+     */
     Ctxt convbn1632sxV2(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
     Ctxt convbn1632dxV2(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
+    Ctxt convbn3264sxV2(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
+    Ctxt convbn3264dxV2(const Ctxt &in, int layer, int n, double scale = 0.5, bool timing = false);
 
 
     /*
@@ -129,13 +242,134 @@ public:
 
     Ptxt mask_mod(int n, int level, double custom_val);
 
+    //Masks requested again in a phase, by (kind, parameters, level, slots), are kept until its keys are cleared
+    void clear_mask_cache();
+    bool use_mask_cache = true;
+
     void bootstrap_precision(const Ctxt& c);
 
+    /*
+     * Bootstrapping policy, from bootstrap-policy.txt in the parameters folder:
+     *   "slots S CTOS STOC": level budget of the bootstrappings of S slots, with the same depth as the context
+     *   "site ITERATIONS PRECISION SCOPE#N": iterations of the N-th bootstrapping of a block, and the precision (bits)
+     *                                        of its first iteration
+     * Bootstrappings not listed use a single iteration and the level budget of the context.
+     */
+    void load_bootstrap_policy();
+
+    //When set, every bootstrapping is single and its precision is measured, sites below these bits get two iterations
+    double bootstrap_required_bits = 0;
+    void write_bootstrap_policy();
+
+    /*
+     * Tracing of the homomorphic operations, disabled by default
+     */
+    Tracer tracer;
+
+    /*
+     * Memory telemetry: sampled RSS by scope, and bytes held by keys and precomputations
+     */
+    MemoryMonitor memory{tracer};
+    static size_t ciphertext_bytes(const Ctxt& c);
+    static size_t plaintext_bytes(const ConstPlaintext& p);
+    //Bytes of the encoded linear transforms of EvalBootstrapSetup, 0 if there are none for these slots
+    size_t bootstrap_precomputation_size(int bootstrap_slots);
+    size_t rotation_key_bytes();
+
+    /*
+     * Dry run: no context, keys or weights, operations are recorded in the cost model with the level and slots they
+     * would have, to predict the time of each layer and the rotation keys of each phase
+     */
+    bool dry_run = false;
+    CostModel cost_model;
+
+    //Mean time of the traced operations, the timing table of the dry run
+    void save_timings(const string& filename);
+
     int relu_degree = 119;
     string parameters_folder = "NO_FOLDER";
 
 private:
     KeyPair<DCRTPoly> key_pair;
+
+    std::unique_ptr<RotationKeyStore> key_store;
+
+    string key_format_filename() const;
+    void write_key_format();
+    string read_key_format() const;
+
+    //Level of the last bootstrapped ciphertext
+    int bootstrap_level = -1;
+    //Level at which the residuals are consumed, by number of slots
+    map<int, int> residual_levels;
+
+    struct BootstrapSite {
+        int iterations;
+        int precision;
+    };
+
+    map<int, vector<uint32_t>> slot_level_budget;
+    map<string, BootstrapSite> site_policy;
+    map<string, double> measured_site_bits;
+    //While calibrating: level of the input of the bootstrapping following each site, the deepest one
+    map<string, int> site_end_level;
+    string previous_site;
+
+    //Scope of the last bootstrapping, and how many bootstrappings it had
+    string site_scope;
+    int site_ordinal = 0;
+
+    string bootstrap_policy_filename() const;
+    //Level budgets of the generated bootstrapping keys, by number of slots
+    string bootstrap_keys_filename() const;
+    void check_bootstrap_keys() const;
+    string bootstrap_site();
+    vector<uint32_t> level_budget_for(int bootstrap_slots) const;
+
+    //Bytes of the plaintexts built by EvalBootstrapSetup, by number of slots
+    map<int, long long> bootstrap_precomputation_bytes;
+
+    //Checkpoint being written in background
+    std::future<bool> pending_checkpoint;
+    string pending_checkpoint_name;
+
+    string checkpoint_filename(const string& name) const;
+
+    //Keys loaded by host_keys, by phase
+    map<string, std::shared_ptr<RotationKeyStore::KeyMap>> hosted_keys;
+
+    //Encoded masks, by kind/parameters/level/slots
+    map<string, Ptxt> mask_cache;
+    map<string, int> mask_requests;
+    Ptxt cached_mask(const string& key, int level, int plaintext_num_slots, const std::function<vector<double>()>& build);
+
+    void load_automorphism_keys(const string& filename, bool verbose, const vector<int>& rotations = {});
+
+    //Ciphertext without polynomials, carrying the metadata of the dry run
+    static Ctxt dry_ciphertext(int level, int slots, int noise_scale_deg);
+    Ctxt dry_op(const char* name, const Ctxt& c, int level, int noise_scale_deg, int index = 0, int hops = 1);
+    static int rescaled_level(const Ctxt& c);
+    //Removes the last towers of c, failing if the context does not drop them
+    Ctxt drop_levels(const Ctxt& c, int levels);
+    int dry_bootstrap_level() const;
+
+    //Keys of the loaded phase, and the keys composing each rotation requested so far
+    string phase_filename;
+    vector<int> phase_keys;
+    map<int, vector<int>> rotation_routes;
+
+    string key_plan_filename() const;
+    int rotation_modulus() const;
+    bool has_rotation_key(int index) const;
+    void select_key_phase(const string& filename);
+    const vector<int>& rotation_route(int index);
+    void advise_huge_pages(bool verbose);
+
+    //The 9 taps of each of the given output channels, read with read_tap(channel, tap) and encoded in one batch
+    vector<vector<Ptxt>> encode_taps(int channels, const std::function<vector<double>(int, int)>& read_tap, int level, int plaintext_num_slots);
+
+    Ptxt fullslot_weight(const string &prefix, int j, int k, int channels, double scale, int level);
+    vector<double> fullslot_values(const string &prefix, int j, int k, int channels, double scale);
     vector<uint32_t> level_budget = {4, 4};
 
 
@@ -0,0 +1,104 @@
+#include "HugePages.h"
+
+#include <fstream>
+#include <sys/mman.h>
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+namespace hugepages {
+
+    static const uintptr_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+    static const uintptr_t SMALL_PAGE_SIZE = 4096;
+
+    bool available() {
+        ifstream in("/sys/kernel/mm/transparent_hugepage/enabled");
+        string mode;
+        getline(in, mode);
+
+        //The active mode is the one in brackets, e.g. "always [madvise] never"
+        return !mode.empty() && mode.find("[never]") == string::npos;
+    }
+
+    //Bit of the glibc chunk header (the word before the pointer) set when the chunk has its own mapping
+    static const size_t IS_MMAPPED = 0x2;
+
+    static void add_poly(vector<pair<uintptr_t, uintptr_t>>& ranges, const DCRTPoly& poly) {
+        for (size_t i = 0; i < poly.GetNumOfElements(); i++) {
+            const NativeVector& values = poly.GetElementAtIndex(i).GetValues();
+            const size_t* data = reinterpret_cast<const size_t*>(&values[0]);
+            if (!(data[-1] & IS_MMAPPED)) continue;
+
+            //The mapping starts with the chunk header, on the page of the data, and ends on the page of its last word
+            uintptr_t begin = reinterpret_cast<uintptr_t>(data) / SMALL_PAGE_SIZE * SMALL_PAGE_SIZE;
+            uintptr_t end = reinterpret_cast<uintptr_t>(data) + values.GetLength() * sizeof(uint64_t);
+            ranges.emplace_back(begin, (end + SMALL_PAGE_SIZE - 1) / SMALL_PAGE_SIZE * SMALL_PAGE_SIZE);
+        }
+    }
+
+    static void add_key(vector<pair<uintptr_t, uintptr_t>>& ranges, const EvalKey<DCRTPoly>& key) {
+        auto relin = std::dynamic_pointer_cast<EvalKeyRelinImpl<DCRTPoly>>(key);
+        for (const DCRTPoly& poly : relin->GetAVector()) add_poly(ranges, poly);
+        for (const DCRTPoly& poly : relin->GetBVector()) add_poly(ranges, poly);
+    }
+
+    static size_t advise(vector<pair<uintptr_t, uintptr_t>>& ranges) {
+        if (ranges.empty()) {
+            return 0;
+        }
+
+        size_t advised = 0;
+        for (const auto& [begin, end] : ranges) {
+            madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE);
+            advised += end - begin;
+        }
+
+        //Only mappings that touch each other (no gap at all) are joined, then the huge pages inside them are collapsed
+        sort(ranges.begin(), ranges.end());
+
+        vector<pair<uintptr_t, uintptr_t>> merged = {ranges[0]};
+        for (size_t i = 1; i < ranges.size(); i++) {
+            if (ranges[i].first == merged.back().second) {
+                merged.back().second = ranges[i].second;
+            } else {
+                merged.push_back(ranges[i]);
+            }
+        }
+
+        for (const auto& [begin, end] : merged) {
+            uintptr_t aligned_begin = (begin + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            uintptr_t aligned_end = end / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            if (aligned_end <= aligned_begin) continue;
+
+            //Pages already populated are collapsed now (Linux >= 6.1), otherwise later by khugepaged
+            madvise(reinterpret_cast<void*>(aligned_begin), aligned_end - aligned_begin, MADV_COLLAPSE);
+        }
+
+        return advised;
+    }
+
+    size_t advise_keys(const KeyMap& keys) {
+        vector<pair<uintptr_t, uintptr_t>> ranges;
+        for (const auto& [index, key] : keys) add_key(ranges, key);
+        return advise(ranges);
+    }
+
+    size_t advise_keys(const vector<EvalKey<DCRTPoly>>& keys) {
+        vector<pair<uintptr_t, uintptr_t>> ranges;
+        for (const auto& key : keys) add_key(ranges, key);
+        return advise(ranges);
+    }
+
+    size_t huge_page_bytes() {
+        ifstream in("/proc/self/smaps_rollup");
+        string line;
+        while (getline(in, line)) {
+            if (line.rfind("AnonHugePages:", 0) == 0) {
+                return stoull(line.substr(line.find(':') + 1)) * 1024;
+            }
+        }
+        return 0;
+    }
+
+}
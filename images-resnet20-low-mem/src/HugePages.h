@@ -0,0 +1,36 @@
+#ifndef LOWMEMORYFHERESNET20_HUGEPAGES_H
+#define LOWMEMORYFHERESNET20_HUGEPAGES_H
+
+#include "openfhe.h"
+
+#include <map>
+
+using namespace lbcrypto;
+using namespace std;
+
+/*
+ * Transparent huge pages (2 MB) for the evaluation keys.
+ *
+ * Keys are allocated with one mapping per RNS limb (see utils::KeyAllocation), so that freeing them between phases
+ * unmaps them. Only those mappings are advised, each exactly: the kernel merges the adjacent ones (they are created
+ * one after the other), so the keys can be backed by huge pages, collapsed immediately when MADV_COLLAPSE is
+ * supported. Limbs that ended up in the heap are left alone, as the pages around them belong to other allocations.
+ * Everything falls back to normal pages when transparent huge pages are disabled.
+ */
+namespace hugepages {
+
+    using KeyMap = std::map<usint, EvalKey<DCRTPoly>>;
+
+    //False when /sys/kernel/mm/transparent_hugepage/enabled is "never" (or missing)
+    bool available();
+
+    //Returns the number of bytes advised
+    size_t advise_keys(const KeyMap& keys);
+    size_t advise_keys(const vector<EvalKey<DCRTPoly>>& keys);
+
+    //Memory of the process backed by huge pages (AnonHugePages of /proc/self/smaps_rollup)
+    size_t huge_page_bytes();
+
+}
+
+#endif //LOWMEMORYFHERESNET20_HUGEPAGES_H
@@ -0,0 +1,99 @@
+#include "MemoryMonitor.h"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+
+static double to_mb(long long bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+MemoryMonitor::~MemoryMonitor() {
+    stop();
+}
+
+size_t MemoryMonitor::current_rss() {
+    //The second field of statm is the number of resident pages
+    ifstream statm("/proc/self/statm");
+    size_t size = 0, resident = 0;
+    statm >> size >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void MemoryMonitor::start(int interval_ms) {
+    if (running()) return;
+
+    stopping = false;
+    sampler = std::thread([this, interval_ms]() {
+        while (!stopping) {
+            sample();
+            std::this_thread::sleep_for(chrono::milliseconds(interval_ms));
+        }
+    });
+}
+
+void MemoryMonitor::stop() {
+    if (!running()) return;
+
+    stopping = true;
+    sampler.join();
+}
+
+void MemoryMonitor::sample() {
+    size_t rss = current_rss();
+    string scope = tracer.current_scope();
+    if (scope.empty()) scope = "-";
+
+    lock_guard<mutex> guard(lock);
+    size_t& scope_peak = scope_peaks[scope];
+    scope_peak = max(scope_peak, rss);
+
+    if (rss > peak) {
+        peak = rss;
+        peak_scope = scope;
+    }
+}
+
+void MemoryMonitor::set_bytes(const string& category, size_t bytes) {
+    lock_guard<mutex> guard(lock);
+    objects[category] = static_cast<long long>(bytes);
+}
+
+void MemoryMonitor::add_bytes(const string& category, long long bytes) {
+    lock_guard<mutex> guard(lock);
+    objects[category] += bytes;
+}
+
+void MemoryMonitor::report(const string& label, size_t live_ciphertext_bytes) {
+    if (!running()) return;
+
+    sample();
+
+    lock_guard<mutex> guard(lock);
+
+    cout << fixed << setprecision(1);
+    cout << "Memory (" << label << "): RSS " << to_mb(current_rss()) << " MB, peak " << to_mb(peak) << " MB";
+    for (const auto& [category, bytes] : objects) {
+        cout << ", " << category << " " << to_mb(bytes) << " MB";
+    }
+    if (live_ciphertext_bytes > 0) {
+        cout << ", live ciphertexts " << to_mb(live_ciphertext_bytes) << " MB";
+    }
+    cout << endl;
+    cout.unsetf(ios::fixed);
+}
+
+void MemoryMonitor::print_summary() {
+    if (!running()) return;
+
+    lock_guard<mutex> guard(lock);
+
+    cout << left << setw(24) << "Scope" << right << setw(16) << "Peak RSS (MB)" << endl;
+    cout << fixed << setprecision(1);
+    for (const auto& [scope, scope_peak] : scope_peaks) {
+        cout << left << setw(24) << scope << right << setw(16) << to_mb(scope_peak) << endl;
+    }
+    cout << "The peak of " << to_mb(peak) << " MB is reached in \"" << peak_scope << "\"" << endl;
+    cout.unsetf(ios::fixed);
+}
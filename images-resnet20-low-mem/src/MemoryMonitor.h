@@ -0,0 +1,50 @@
+#ifndef LOWMEMORYFHERESNET20_MEMORYMONITOR_H
+#define LOWMEMORYFHERESNET20_MEMORYMONITOR_H
+
+#include "Tracer.h"
+
+#include <map>
+#include <atomic>
+#include <thread>
+
+/*
+ * Samples the resident memory of the process (/proc/self/statm) on a background thread, and attributes each sample
+ * to the current scope of the tracer (e.g. "Layer2/Block 1"), keeping the peak of each scope.
+ * Next to the sampled RSS, it keeps the bytes held by each kind of object (rotation keys, bootstrapping
+ * precomputations, cached plaintexts, ...), updated by FHEController when they are loaded or released.
+ */
+class MemoryMonitor {
+public:
+    explicit MemoryMonitor(Tracer& tracer) : tracer(tracer) {}
+    ~MemoryMonitor();
+
+    void start(int interval_ms = 20);
+    void stop();
+    bool running() const { return sampler.joinable(); }
+
+    static size_t current_rss();
+
+    //Object-level accounting, in bytes
+    void set_bytes(const string& category, size_t bytes);
+    void add_bytes(const string& category, long long bytes);
+
+    void report(const string& label, size_t live_ciphertext_bytes = 0);
+    void print_summary();
+
+private:
+    Tracer& tracer;
+
+    std::thread sampler;
+    std::atomic<bool> stopping{false};
+
+    std::mutex lock;
+    map<string, size_t> scope_peaks;
+    map<string, long long> objects;
+    size_t peak = 0;
+    string peak_scope;
+
+    void sample();
+};
+
+
+#endif //LOWMEMORYFHERESNET20_MEMORYMONITOR_H
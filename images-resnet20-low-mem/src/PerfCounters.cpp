@@ -0,0 +1,76 @@
+#include "PerfCounters.h"
+
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+static int open_counter(uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    //This process and its future threads, on any CPU
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+PerfCounters::~PerfCounters() {
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+}
+
+bool PerfCounters::open() {
+    fds[CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fds[INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fds[LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    fds[DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                                        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+    //Cycles and instructions are required, the other counters are reported as zero when missing
+    opened = fds[CYCLES] >= 0 && fds[INSTRUCTIONS] >= 0;
+
+    if (!opened) {
+        cerr << "Hardware counters are not available (" << strerror(errno) << "), check kernel.perf_event_paranoid" << endl;
+    }
+
+    return opened;
+}
+
+PerfCounters::Values PerfCounters::read() const {
+    Values values{};
+
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        uint64_t value = 0;
+        if (fds[i] >= 0 && ::read(fds[i], &value, sizeof(value)) == sizeof(value)) {
+            values[i] = value;
+        }
+    }
+
+    return values;
+}
+
+const char* PerfCounters::name(int counter) {
+    switch (counter) {
+        case CYCLES:
+            return "cycles";
+        case INSTRUCTIONS:
+            return "instructions";
+        case LLC_MISSES:
+            return "llc_misses";
+        case DTLB_MISSES:
+            return "dtlb_misses";
+    }
+
+    return "?";
+}
@@ -0,0 +1,34 @@
+#ifndef LOWMEMORYFHERESNET20_PERFCOUNTERS_H
+#define LOWMEMORYFHERESNET20_PERFCOUNTERS_H
+
+#include <array>
+#include <cstdint>
+
+/*
+ * Hardware counters of the whole process (perf_event_open): cycles, instructions, last level cache misses and
+ * dTLB load misses. Counters are inherited by the threads created after open(), so they must be opened before the
+ * OpenMP pool starts, and a read on the main thread includes the work of all the OpenMP threads.
+ * The memory bandwidth is estimated from the LLC misses (one 64 bytes line each).
+ */
+class PerfCounters {
+public:
+    enum Counter { CYCLES, INSTRUCTIONS, LLC_MISSES, DTLB_MISSES, NUM_COUNTERS };
+    using Values = std::array<uint64_t, NUM_COUNTERS>;
+
+    ~PerfCounters();
+
+    //False if perf events are not available (e.g. kernel.perf_event_paranoid too high, or in a container)
+    bool open();
+    bool available() const { return opened; }
+
+    Values read() const;
+
+    static const char* name(int counter);
+
+private:
+    std::array<int, NUM_COUNTERS> fds{-1, -1, -1, -1};
+    bool opened = false;
+};
+
+
+#endif //LOWMEMORYFHERESNET20_PERFCOUNTERS_H
@@ -0,0 +1,368 @@
+#include "RawContainer.h"
+
+#include <fstream>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace raw {
+
+    static const char RAW_MAGIC[8] = {'R', 'A', 'W', 'F', 'H', 'E', '0', '1'};
+
+    static const uint32_t KIND_CIPHERTEXT = 1;
+    static const uint32_t KIND_KEY = 2;
+
+    //Limbs are copied as arrays of 64-bit words
+    static_assert(sizeof(NativeInteger) == sizeof(uint64_t), "NativeInteger must be a 64-bit word");
+
+    struct Object {
+        uint32_t kind = 0;
+        uint32_t index = 0;
+        string tag;
+
+        uint32_t cyclotomic_order = 0;
+        vector<uint64_t> moduli;
+        vector<uint64_t> roots;
+
+        uint32_t level = 0;
+        uint32_t noise_scale_deg = 0;
+        double scaling_factor = 0;
+        uint32_t slots = 0;
+        uint32_t encoding = 0;
+
+        uint32_t num_polys = 0;
+        uint64_t offset = 0;
+    };
+
+    template <typename T>
+    static void write_value(ostream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static T read_value(istream& in) {
+        T value;
+        in.read(reinterpret_cast<char*>(&value), sizeof(T));
+        return value;
+    }
+
+    static uint64_t page_align(uint64_t value) {
+        uint64_t page = sysconf(_SC_PAGESIZE);
+        return (value + page - 1) / page * page;
+    }
+
+    static uint64_t limb_stride(const Object& object) {
+        return page_align(object.cyclotomic_order / 2 * sizeof(uint64_t));
+    }
+
+    /*
+     * Writing
+     */
+    static void write_polys(ofstream& out, uint64_t& offset, const vector<DCRTPoly>& polys, Object& object) {
+        auto params = polys[0].GetParams();
+
+        object.cyclotomic_order = params->GetCyclotomicOrder();
+        for (const auto& limb_params : params->GetParams()) {
+            object.moduli.push_back(limb_params->GetModulus().ConvertToInt());
+            object.roots.push_back(limb_params->GetRootOfUnity().ConvertToInt());
+        }
+        object.num_polys = static_cast<uint32_t>(polys.size());
+        object.offset = offset;
+
+        uint64_t stride = limb_stride(object);
+        string padding(stride, '\0');
+
+        for (const DCRTPoly& poly : polys) {
+            DCRTPoly evaluation = poly;
+            if (evaluation.GetFormat() != Format::EVALUATION) {
+                evaluation.SetFormat(Format::EVALUATION);
+            }
+
+            for (size_t i = 0; i < evaluation.GetNumOfElements(); i++) {
+                const NativeVector& values = evaluation.GetElementAtIndex(i).GetValues();
+                uint64_t bytes = values.GetLength() * sizeof(uint64_t);
+
+                out.write(reinterpret_cast<const char*>(&values[0]), static_cast<streamsize>(bytes));
+                out.write(padding.data(), static_cast<streamsize>(stride - bytes));
+                offset += stride;
+            }
+        }
+    }
+
+    static bool write_table(ofstream& out, uint64_t table_offset, const vector<Object>& objects) {
+        write_value<uint32_t>(out, static_cast<uint32_t>(objects.size()));
+
+        for (const Object& object : objects) {
+            write_value<uint32_t>(out, object.kind);
+            write_value<uint32_t>(out, object.index);
+            write_value<uint32_t>(out, static_cast<uint32_t>(object.tag.size()));
+            out.write(object.tag.data(), static_cast<streamsize>(object.tag.size()));
+
+            write_value<uint32_t>(out, object.cyclotomic_order);
+            write_value<uint32_t>(out, static_cast<uint32_t>(object.moduli.size()));
+            for (size_t i = 0; i < object.moduli.size(); i++) {
+                write_value<uint64_t>(out, object.moduli[i]);
+                write_value<uint64_t>(out, object.roots[i]);
+            }
+
+            write_value<uint32_t>(out, object.level);
+            write_value<uint32_t>(out, object.noise_scale_deg);
+            write_value<double>(out, object.scaling_factor);
+            write_value<uint32_t>(out, object.slots);
+            write_value<uint32_t>(out, object.encoding);
+
+            write_value<uint32_t>(out, object.num_polys);
+            write_value<uint64_t>(out, object.offset);
+        }
+
+        write_value<uint64_t>(out, table_offset);
+        out.write(RAW_MAGIC, sizeof(RAW_MAGIC));
+
+        return out.good();
+    }
+
+    /*
+     * Reading
+     */
+    static bool read_table(const string& filename, vector<Object>& objects) {
+        ifstream in(filename, ios::in | ios::binary);
+        if (!in.is_open()) {
+            return false;
+        }
+
+        in.seekg(-static_cast<streamoff>(sizeof(uint64_t) + sizeof(RAW_MAGIC)), ios::end);
+        uint64_t table_offset = read_value<uint64_t>(in);
+        char magic[sizeof(RAW_MAGIC)];
+        in.read(magic, sizeof(magic));
+
+        if (!in.good() || memcmp(magic, RAW_MAGIC, sizeof(RAW_MAGIC)) != 0) {
+            cerr << "\"" << filename << "\" is not a raw container" << endl;
+            return false;
+        }
+
+        in.seekg(static_cast<streamoff>(table_offset), ios::beg);
+
+        objects.resize(read_value<uint32_t>(in));
+        for (Object& object : objects) {
+            object.kind = read_value<uint32_t>(in);
+            object.index = read_value<uint32_t>(in);
+            object.tag.resize(read_value<uint32_t>(in));
+            in.read(&object.tag[0], static_cast<streamsize>(object.tag.size()));
+
+            object.cyclotomic_order = read_value<uint32_t>(in);
+            uint32_t limbs = read_value<uint32_t>(in);
+            for (uint32_t i = 0; i < limbs; i++) {
+                object.moduli.push_back(read_value<uint64_t>(in));
+                object.roots.push_back(read_value<uint64_t>(in));
+            }
+
+            object.level = read_value<uint32_t>(in);
+            object.noise_scale_deg = read_value<uint32_t>(in);
+            object.scaling_factor = read_value<double>(in);
+            object.slots = read_value<uint32_t>(in);
+            object.encoding = read_value<uint32_t>(in);
+
+            object.num_polys = read_value<uint32_t>(in);
+            object.offset = read_value<uint64_t>(in);
+        }
+
+        if (!in.good()) {
+            cerr << "The table of \"" << filename << "\" is corrupted" << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    //Read-only mapping of the whole file, or nullptr
+    static char* map_file(const string& filename, size_t& size) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        char* mapped = nullptr;
+        struct stat sb;
+        if (fstat(fd, &sb) == 0) {
+            void* address = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                mapped = static_cast<char*>(address);
+                size = sb.st_size;
+                madvise(mapped, size, MADV_SEQUENTIAL);
+            }
+        }
+        ::close(fd);
+
+        return mapped;
+    }
+
+    //One memcpy per limb from the mapped file into freshly allocated polynomials
+    static vector<DCRTPoly> adopt_polys(const char* mapped, size_t mapped_size, const Object& object) {
+        vector<NativeInteger> moduli(object.moduli.begin(), object.moduli.end());
+        vector<NativeInteger> roots(object.roots.begin(), object.roots.end());
+        auto params = std::make_shared<DCRTPoly::Params>(object.cyclotomic_order, moduli, roots);
+
+        size_t limbs = moduli.size();
+        uint64_t stride = limb_stride(object);
+        uint64_t bytes = object.cyclotomic_order / 2 * sizeof(uint64_t);
+
+        if (object.offset + object.num_polys * limbs * stride > mapped_size) {
+            return {};
+        }
+
+        vector<DCRTPoly> polys(object.num_polys);
+        for (DCRTPoly& poly : polys) {
+            poly = DCRTPoly(params, Format::EVALUATION, true);
+        }
+
+#pragma omp parallel for collapse(2)
+        for (size_t p = 0; p < polys.size(); p++) {
+            for (size_t i = 0; i < limbs; i++) {
+                NativePoly& limb = polys[p].GetAllElements()[i];
+                memcpy(&limb[0], mapped + object.offset + (p * limbs + i) * stride, bytes);
+            }
+        }
+
+        return polys;
+    }
+
+    bool serialize_ciphertext(const string& filename, const Ciphertext<DCRTPoly>& c) {
+        ofstream out(filename, ios::out | ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            return false;
+        }
+
+        Object object;
+        object.kind = KIND_CIPHERTEXT;
+        object.tag = c->GetKeyTag();
+        object.level = static_cast<uint32_t>(c->GetLevel());
+        object.noise_scale_deg = static_cast<uint32_t>(c->GetNoiseScaleDeg());
+        object.scaling_factor = c->GetScalingFactor();
+        object.slots = static_cast<uint32_t>(c->GetSlots());
+        object.encoding = static_cast<uint32_t>(c->GetEncodingType());
+
+        uint64_t offset = 0;
+        write_polys(out, offset, c->GetElements(), object);
+
+        return write_table(out, offset, {object});
+    }
+
+    bool deserialize_ciphertext(const string& filename, const CryptoContext<DCRTPoly>& context, Ciphertext<DCRTPoly>& c) {
+        vector<Object> objects;
+        if (!read_table(filename, objects)) {
+            return false;
+        }
+
+        if (objects.size() != 1 || objects[0].kind != KIND_CIPHERTEXT) {
+            cerr << "\"" << filename << "\" does not contain a ciphertext" << endl;
+            return false;
+        }
+
+        size_t mapped_size = 0;
+        char* mapped = map_file(filename, mapped_size);
+        if (mapped == nullptr) {
+            return false;
+        }
+
+        const Object& object = objects[0];
+        vector<DCRTPoly> elements = adopt_polys(mapped, mapped_size, object);
+        munmap(mapped, mapped_size);
+
+        if (elements.empty()) {
+            cerr << "\"" << filename << "\" is truncated" << endl;
+            return false;
+        }
+
+        c = std::make_shared<CiphertextImpl<DCRTPoly>>(context, object.tag, static_cast<PlaintextEncodings>(object.encoding));
+        c->SetElements(std::move(elements));
+        c->SetLevel(object.level);
+        c->SetNoiseScaleDeg(object.noise_scale_deg);
+        c->SetScalingFactor(object.scaling_factor);
+        c->SetSlots(object.slots);
+
+        return true;
+    }
+
+    bool serialize_keys(const string& filename, const KeyMap& keys) {
+        ofstream out(filename, ios::out | ios::binary | ios::trunc);
+        if (!out.is_open()) {
+            return false;
+        }
+
+        vector<Object> objects;
+        uint64_t offset = 0;
+
+        for (const auto& [index, key] : keys) {
+            auto relin = std::dynamic_pointer_cast<EvalKeyRelinImpl<DCRTPoly>>(key);
+
+            //The a parts first, then the b parts
+            vector<DCRTPoly> polys = relin->GetAVector();
+            const vector<DCRTPoly>& b = relin->GetBVector();
+            polys.insert(polys.end(), b.begin(), b.end());
+
+            Object object;
+            object.kind = KIND_KEY;
+            object.index = index;
+            object.tag = key->GetKeyTag();
+
+            write_polys(out, offset, polys, object);
+            objects.push_back(std::move(object));
+
+            if (!out.good()) {
+                return false;
+            }
+        }
+
+        return write_table(out, offset, objects);
+    }
+
+    std::shared_ptr<KeyMap> deserialize_keys(const string& filename, const CryptoContext<DCRTPoly>& context) {
+        vector<Object> objects;
+        if (!read_table(filename, objects)) {
+            return nullptr;
+        }
+
+        size_t mapped_size = 0;
+        char* mapped = map_file(filename, mapped_size);
+        if (mapped == nullptr) {
+            return nullptr;
+        }
+
+        auto keys = std::make_shared<KeyMap>();
+
+        for (const Object& object : objects) {
+            if (object.kind != KIND_KEY) {
+                cerr << "\"" << filename << "\" contains an object that is not a key" << endl;
+                munmap(mapped, mapped_size);
+                return nullptr;
+            }
+
+            vector<DCRTPoly> polys = adopt_polys(mapped, mapped_size, object);
+            if (polys.empty()) {
+                cerr << "Key " << object.index << " of \"" << filename << "\" is truncated" << endl;
+                munmap(mapped, mapped_size);
+                return nullptr;
+            }
+
+            size_t digits = polys.size() / 2;
+
+            auto key = std::make_shared<EvalKeyRelinImpl<DCRTPoly>>(context);
+            key->SetKeyTag(object.tag);
+            key->SetAVector(vector<DCRTPoly>(polys.begin(), polys.begin() + digits));
+            key->SetBVector(vector<DCRTPoly>(polys.begin() + digits, polys.end()));
+
+            (*keys)[object.index] = key;
+
+            //The private mapping is not needed anymore, the pages stay in the (shared) page cache
+            uint64_t begin = object.offset;
+            madvise(mapped + begin, polys.size() * object.moduli.size() * limb_stride(object), MADV_DONTNEED);
+        }
+
+        munmap(mapped, mapped_size);
+
+        return keys;
+    }
+
+}
@@ -0,0 +1,35 @@
+#ifndef LOWMEMORYFHERESNET20_RAWCONTAINER_H
+#define LOWMEMORYFHERESNET20_RAWCONTAINER_H
+
+#include "openfhe.h"
+
+#include <map>
+
+using namespace lbcrypto;
+using namespace std;
+
+/*
+ * Flat container for ciphertexts and key-switching keys, with the RNS limbs stored as raw 64-bit words.
+ *
+ * Layout: [limbs] [object table] [table offset (uint64)] [magic (8 bytes)]
+ * Each limb (in evaluation format) starts at a page boundary, polynomials are stored one after the other, and the
+ * table describes each object (index, key tag, cyclotomic order, moduli and roots of unity, level, noise scale degree,
+ * scaling factor, slots, offset of the first limb).
+ *
+ * On load the file is memory-mapped and each limb is adopted with a single memcpy in the DCRTPoly storage, instead of
+ * being decoded element by element: the load runs at about the disk (or page cache) bandwidth, and the page cache is
+ * shared by all the processes reading the same file.
+ */
+namespace raw {
+
+    using KeyMap = std::map<usint, EvalKey<DCRTPoly>>;
+
+    bool serialize_ciphertext(const string& filename, const Ciphertext<DCRTPoly>& c);
+    bool deserialize_ciphertext(const string& filename, const CryptoContext<DCRTPoly>& context, Ciphertext<DCRTPoly>& c);
+
+    bool serialize_keys(const string& filename, const KeyMap& keys);
+    std::shared_ptr<KeyMap> deserialize_keys(const string& filename, const CryptoContext<DCRTPoly>& context);
+
+}
+
+#endif //LOWMEMORYFHERESNET20_RAWCONTAINER_H
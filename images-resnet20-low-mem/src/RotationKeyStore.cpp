@@ -0,0 +1,284 @@
+#include "RotationKeyStore.h"
+
+#include <sstream>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static const char STORE_MAGIC[8] = {'R', 'O', 'T', 'K', 'E', 'Y', 'S', '1'};
+
+//Read-only stream over a memory region, so that a mapped record can be deserialized without copying it
+struct MemoryBuffer : std::streambuf {
+    MemoryBuffer(char* begin, size_t size) {
+        setg(begin, begin, begin + size);
+    }
+};
+
+template <typename T>
+static void write_value(ofstream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static T read_value(istream& in) {
+    T value;
+    in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    return value;
+}
+
+RotationKeyStore::~RotationKeyStore() {
+    if (writer.is_open()) {
+        close();
+    }
+
+    if (mapped != nullptr) {
+        munmap(mapped, mapped_size);
+    }
+}
+
+uint64_t RotationKeyStore::checksum(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+void RotationKeyStore::add_phase(const string& phase, const KeyMap& keys) {
+    if (!writer.is_open()) {
+        //A new store: records read by open() belong to the keys being replaced, and are never shared with these
+        records.clear();
+        phases.clear();
+        resident_bytes = 0;
+        if (mapped != nullptr) {
+            munmap(mapped, mapped_size);
+            mapped = nullptr;
+            mapped_size = 0;
+        }
+
+        writer.open(path, ios::out | ios::binary | ios::trunc);
+        if (!writer.is_open()) {
+            cerr << "Could not create the key store in \"" << path << "\"" << endl;
+            exit(1);
+        }
+        write_offset = 0;
+    }
+
+    vector<usint>& indices = phases[phase];
+    int written = 0;
+
+    for (const auto& [index, key] : keys) {
+        indices.push_back(index);
+
+        //Keys shared with previous phases are already in the store
+        if (records.count(index)) continue;
+
+        ostringstream stream;
+        Serial::Serialize(key, stream, SerType::BINARY);
+        string data = stream.str();
+
+        writer.write(data.data(), static_cast<streamsize>(data.size()));
+        if (!writer.good()) {
+            cerr << "Error writing key " << index << " in the key store" << endl;
+            exit(1);
+        }
+
+        records[index] = {write_offset, data.size(), checksum(data.data(), data.size())};
+        write_offset += data.size();
+        written++;
+    }
+
+    cout << "Key store: phase \"" << phase << "\" has " << indices.size() << " keys, "
+         << indices.size() - written << " shared with previous phases" << endl;
+}
+
+void RotationKeyStore::close() {
+    uint64_t table_offset = write_offset;
+
+    write_value<uint32_t>(writer, static_cast<uint32_t>(records.size()));
+    for (const auto& [index, record] : records) {
+        write_value<uint32_t>(writer, index);
+        write_value<uint64_t>(writer, record.offset);
+        write_value<uint64_t>(writer, record.size);
+        write_value<uint64_t>(writer, record.checksum);
+    }
+
+    write_value<uint32_t>(writer, static_cast<uint32_t>(phases.size()));
+    for (const auto& [name, indices] : phases) {
+        write_value<uint32_t>(writer, static_cast<uint32_t>(name.size()));
+        writer.write(name.data(), static_cast<streamsize>(name.size()));
+        write_value<uint32_t>(writer, static_cast<uint32_t>(indices.size()));
+        for (usint index : indices) {
+            write_value<uint32_t>(writer, index);
+        }
+    }
+
+    write_value<uint64_t>(writer, table_offset);
+    writer.write(STORE_MAGIC, sizeof(STORE_MAGIC));
+    writer.close();
+}
+
+bool RotationKeyStore::open() {
+    ifstream in(path, ios::in | ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+
+    in.seekg(-static_cast<streamoff>(sizeof(uint64_t) + sizeof(STORE_MAGIC)), ios::end);
+    uint64_t table_offset = read_value<uint64_t>(in);
+    char magic[sizeof(STORE_MAGIC)];
+    in.read(magic, sizeof(magic));
+
+    if (!in.good() || memcmp(magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0) {
+        cerr << "\"" << path << "\" is not a valid key store" << endl;
+        exit(1);
+    }
+
+    in.seekg(static_cast<streamoff>(table_offset), ios::beg);
+
+    uint32_t num_records = read_value<uint32_t>(in);
+    for (uint32_t i = 0; i < num_records; i++) {
+        usint index = read_value<uint32_t>(in);
+        Record record;
+        record.offset = read_value<uint64_t>(in);
+        record.size = read_value<uint64_t>(in);
+        record.checksum = read_value<uint64_t>(in);
+        records[index] = record;
+    }
+
+    uint32_t num_phases = read_value<uint32_t>(in);
+    for (uint32_t i = 0; i < num_phases; i++) {
+        string name(read_value<uint32_t>(in), '\0');
+        in.read(&name[0], static_cast<streamsize>(name.size()));
+        vector<usint>& indices = phases[name];
+        indices.resize(read_value<uint32_t>(in));
+        for (usint& index : indices) {
+            index = read_value<uint32_t>(in);
+        }
+    }
+
+    if (!in.good()) {
+        cerr << "The table of the key store \"" << path << "\" is corrupted" << endl;
+        exit(1);
+    }
+
+    //Records are mapped, so that only the pages of the requested keys are read from disk
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat sb;
+    if (fd >= 0 && fstat(fd, &sb) == 0) {
+        void* address = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            mapped = static_cast<char*>(address);
+            mapped_size = sb.st_size;
+        }
+    }
+    if (fd >= 0) ::close(fd);
+
+    return true;
+}
+
+bool RotationKeyStore::has_phase(const string& phase) const {
+    return phases.count(phase) > 0;
+}
+
+bool RotationKeyStore::read_record(usint index, const Record& record, EvalKey<DCRTPoly>& key) {
+    string copy;
+    char* data;
+
+    if (mapped != nullptr) {
+        data = mapped + record.offset;
+    } else {
+        ifstream in(path, ios::in | ios::binary);
+        in.seekg(static_cast<streamoff>(record.offset), ios::beg);
+        copy.resize(record.size);
+        in.read(&copy[0], static_cast<streamsize>(record.size));
+        data = &copy[0];
+    }
+
+    if (checksum(data, record.size) != record.checksum) {
+        cerr << "Checksum mismatch for key " << index << " in \"" << path << "\"" << endl;
+        return false;
+    }
+
+    MemoryBuffer buffer(data, record.size);
+    istream stream(&buffer);
+    Serial::Deserialize(key, stream, SerType::BINARY);
+
+    //The mapped pages are not needed anymore, once the key is deserialized
+    if (mapped != nullptr) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = record.offset / page * page;
+        madvise(mapped + begin, record.offset + record.size - begin, MADV_DONTNEED);
+    }
+
+    return key != nullptr;
+}
+
+std::shared_ptr<RotationKeyStore::KeyMap> RotationKeyStore::load_phase(const string& phase, const set<usint>& only) {
+    auto keys = std::make_shared<KeyMap>();
+
+    if (!has_phase(phase)) {
+        cerr << "The key store does not contain the phase \"" << phase << "\"" << endl;
+        exit(1);
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    vector<usint> indices;
+
+    for (usint index : phases.at(phase)) {
+        if (!only.empty() && !only.count(index)) continue;
+        indices.push_back(index);
+
+        //Disk reads of the next records overlap with the decoding of the current ones
+        if (mapped != nullptr) {
+            const Record& record = records.at(index);
+            size_t begin = record.offset / page * page;
+            madvise(mapped + begin, record.offset + record.size - begin, MADV_WILLNEED);
+        }
+    }
+
+    //Records are independent, so they are decoded in parallel
+    vector<EvalKey<DCRTPoly>> loaded(indices.size());
+    vector<char> valid(indices.size());
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < indices.size(); i++) {
+        valid[i] = read_record(indices[i], records.at(indices[i]), loaded[i]);
+    }
+
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (!valid[i]) {
+            cerr << "Could not deserialize key " << indices[i] << " of \"" << phase << "\"" << endl;
+            exit(1);
+        }
+
+        (*keys)[indices[i]] = loaded[i];
+        resident_bytes += records.at(indices[i]).size;
+    }
+
+    return keys;
+}
+
+size_t RotationKeyStore::phase_bytes(const string& phase) const {
+    size_t bytes = 0;
+    for (usint index : phases.at(phase)) {
+        bytes += records.at(index).size;
+    }
+    return bytes;
+}
+
+int RotationKeyStore::shared_keys(const string& phase) const {
+    int shared = 0;
+    for (usint index : phases.at(phase)) {
+        for (const auto& [name, indices] : phases) {
+            if (name != phase && find(indices.begin(), indices.end(), index) != indices.end()) {
+                shared++;
+                break;
+            }
+        }
+    }
+    return shared;
+}
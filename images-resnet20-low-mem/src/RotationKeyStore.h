@@ -0,0 +1,69 @@
+#ifndef LOWMEMORYFHERESNET20_ROTATIONKEYSTORE_H
+#define LOWMEMORYFHERESNET20_ROTATIONKEYSTORE_H
+
+#include "openfhe.h"
+#include "key/key-ser.h"
+
+#include <map>
+#include <set>
+#include <fstream>
+
+using namespace lbcrypto;
+using namespace std;
+
+/*
+ * Single-file store of the automorphism (rotation and bootstrapping) keys, with one record per automorphism index.
+ * Keys shared between phases are written once, and each phase (e.g. "rotations-layer2.bin") is a list of indices.
+ *
+ * Layout: [records] [record table] [phase table] [table offset (uint64)] [magic (8 bytes)]
+ * Each record of the table is (automorphism index, offset, size, FNV-1a checksum).
+ */
+class RotationKeyStore {
+public:
+    using KeyMap = std::map<usint, EvalKey<DCRTPoly>>;
+
+    explicit RotationKeyStore(string path) : path(std::move(path)) {}
+    ~RotationKeyStore();
+
+    /*
+     * Writing
+     */
+    void add_phase(const string& phase, const KeyMap& keys);
+    void close();
+
+    /*
+     * Reading
+     */
+    bool open();
+    bool has_phase(const string& phase) const;
+    std::shared_ptr<KeyMap> load_phase(const string& phase, const set<usint>& only = {});
+    size_t phase_bytes(const string& phase) const;
+    int shared_keys(const string& phase) const;
+
+    size_t resident_bytes = 0;
+
+private:
+    struct Record {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t checksum;
+    };
+
+    string path;
+
+    map<usint, Record> records;
+    map<string, vector<usint>> phases;
+
+    ofstream writer;
+    uint64_t write_offset = 0;
+
+    //Memory-mapped file, or nullptr if it could not be mapped
+    char* mapped = nullptr;
+    size_t mapped_size = 0;
+
+    static uint64_t checksum(const char* data, size_t size);
+    bool read_record(usint index, const Record& record, EvalKey<DCRTPoly>& key);
+};
+
+
+#endif //LOWMEMORYFHERESNET20_ROTATIONKEYSTORE_H
@@ -0,0 +1,117 @@
+#include "RotationPlanner.h"
+
+#include <deque>
+#include <algorithm>
+
+int RotationPlanner::reduce(int index, int modulus) {
+    return ((index % modulus) + modulus) % modulus;
+}
+
+vector<int> RotationPlanner::distances(const vector<int>& keys, int modulus) {
+    //Breadth-first search over the rotations, each key is an edge
+    vector<int> distance(modulus, -1);
+    deque<int> queue = {0};
+    distance[0] = 0;
+
+    while (!queue.empty()) {
+        int current = queue.front();
+        queue.pop_front();
+
+        for (int key : keys) {
+            int next = reduce(current + key, modulus);
+            if (distance[next] < 0) {
+                distance[next] = distance[current] + 1;
+                queue.push_back(next);
+            }
+        }
+    }
+
+    return distance;
+}
+
+vector<int> RotationPlanner::route(int index, const vector<int>& keys, int modulus) {
+    int target = reduce(index, modulus);
+    if (target == 0) return {};
+
+    for (int key : keys) {
+        if (reduce(key, modulus) == target) return {key};
+    }
+
+    //Same search as distances(), keeping the key used to reach each rotation
+    vector<int> previous(modulus, -1), used_key(modulus, 0);
+    deque<int> queue = {0};
+    previous[0] = 0;
+
+    while (!queue.empty() && previous[target] < 0) {
+        int current = queue.front();
+        queue.pop_front();
+
+        for (int key : keys) {
+            int next = reduce(current + key, modulus);
+            if (previous[next] < 0) {
+                previous[next] = current;
+                used_key[next] = key;
+                queue.push_back(next);
+            }
+        }
+    }
+
+    vector<int> composition;
+    if (previous[target] < 0) return composition;
+
+    for (int current = target; current != 0; current = previous[current]) {
+        composition.push_back(used_key[current]);
+    }
+    reverse(composition.begin(), composition.end());
+
+    return composition;
+}
+
+long long RotationPlanner::key_switchings(const map<int, int>& requested, const vector<int>& keys, int modulus) {
+    vector<int> distance = distances(keys, modulus);
+
+    long long total = 0;
+    for (const auto& [index, count] : requested) {
+        int hops = distance[reduce(index, modulus)];
+        if (hops < 0) return -1;
+        total += static_cast<long long>(hops) * count;
+    }
+
+    return total;
+}
+
+vector<int> RotationPlanner::choose_keys(const map<int, int>& requested, size_t max_keys, int modulus) {
+    //One key per distinct rotation, with the sign the kernels use
+    vector<int> keys;
+    vector<bool> taken(modulus, false);
+    for (const auto& [index, count] : requested) {
+        int reduced = reduce(index, modulus);
+        if (reduced != 0 && !taken[reduced]) {
+            taken[reduced] = true;
+            keys.push_back(index);
+        }
+    }
+
+    while (max_keys > 0 && keys.size() > max_keys) {
+        long long best_cost = -1;
+        size_t best_key = 0;
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            vector<int> without = keys;
+            without.erase(without.begin() + i);
+
+            long long cost = key_switchings(requested, without, modulus);
+            if (cost >= 0 && (best_cost < 0 || cost < best_cost)) {
+                best_cost = cost;
+                best_key = i;
+            }
+        }
+
+        //No key can be dropped without losing a rotation
+        if (best_cost < 0) break;
+
+        keys.erase(keys.begin() + best_key);
+    }
+
+    return keys;
+}
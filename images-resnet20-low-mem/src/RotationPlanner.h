@@ -0,0 +1,42 @@
+#ifndef LOWMEMORYFHERESNET20_ROTATIONPLANNER_H
+#define LOWMEMORYFHERESNET20_ROTATIONPLANNER_H
+
+#include <vector>
+#include <map>
+
+using namespace std;
+
+/*
+ * Rotation keys of a phase, chosen from the rotations the kernels actually request.
+ *
+ * Rotation keys compose: rotating by a and then by b is a rotation by a + b, modulo the number of slots of the ring
+ * (half the ring dimension). Each rotation is computed as the shortest composition of the keys of its phase, so a
+ * phase can hold fewer keys than the distinct rotations it requests, at the price of more key switchings.
+ */
+class RotationPlanner {
+public:
+    //Routes longer than this are reported: usually a key is missing from the file (e.g. keys older than the plan)
+    static const size_t LONG_ROUTE = 3;
+
+    //Shortest composition of the keys giving the rotation (a single key if there is one), empty if none exists
+    static vector<int> route(int index, const vector<int>& keys, int modulus);
+
+    /*
+     * Keys for the requested rotations (index -> number of times), at most max_keys of them (0: no limit).
+     * Starting from one key per rotation, the key whose removal adds the fewest key switchings is dropped, until the
+     * set fits: every requested rotation stays reachable.
+     */
+    static vector<int> choose_keys(const map<int, int>& requested, size_t max_keys, int modulus);
+
+    //Key switchings needed by the requested rotations with the given keys, -1 if one of them is not reachable
+    static long long key_switchings(const map<int, int>& requested, const vector<int>& keys, int modulus);
+
+private:
+    //Number of keys needed to reach each rotation, -1 where no composition exists
+    static vector<int> distances(const vector<int>& keys, int modulus);
+
+    static int reduce(int index, int modulus);
+};
+
+
+#endif //LOWMEMORYFHERESNET20_ROTATIONPLANNER_H
@@ -0,0 +1,366 @@
+#include "SeedCompression.h"
+
+#include <random>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+
+namespace seeded {
+
+    static const char KEYS_MAGIC[8] = {'S', 'E', 'E', 'D', 'K', 'E', 'Y', '1'};
+    static const char CTXT_MAGIC[8] = {'S', 'E', 'E', 'D', 'C', 'T', 'X', '1'};
+
+    /*
+     * ChaCha20 (RFC 8439) used as a stream PRG
+     */
+    static inline uint32_t rotl(uint32_t x, int n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    static inline void quarter_round(uint32_t* x, int a, int b, int c, int d) {
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 16);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 12);
+        x[a] += x[b]; x[d] = rotl(x[d] ^ x[a], 8);
+        x[c] += x[d]; x[b] = rotl(x[b] ^ x[c], 7);
+    }
+
+    class ChaChaStream {
+    public:
+        ChaChaStream(const Seed& seed, uint32_t nonce0, uint32_t nonce1) {
+            state[0] = 0x61707865; state[1] = 0x3320646e; state[2] = 0x79622d32; state[3] = 0x6b206574;
+            memcpy(&state[4], seed.data(), 32);
+            state[12] = 0;
+            state[13] = nonce0;
+            state[14] = nonce1;
+            state[15] = 0;
+        }
+
+        uint64_t next() {
+            if (position == 16) refill();
+            uint64_t value = block[position] | (static_cast<uint64_t>(block[position + 1]) << 32);
+            position += 2;
+            return value;
+        }
+
+    private:
+        uint32_t state[16];
+        uint32_t block[16];
+        int position = 16;
+
+        void refill() {
+            memcpy(block, state, sizeof(block));
+            for (int i = 0; i < 10; i++) {
+                quarter_round(block, 0, 4, 8, 12);
+                quarter_round(block, 1, 5, 9, 13);
+                quarter_round(block, 2, 6, 10, 14);
+                quarter_round(block, 3, 7, 11, 15);
+                quarter_round(block, 0, 5, 10, 15);
+                quarter_round(block, 1, 6, 11, 12);
+                quarter_round(block, 2, 7, 8, 13);
+                quarter_round(block, 3, 4, 9, 14);
+            }
+            for (int i = 0; i < 16; i++) block[i] += state[i];
+            state[12]++;
+            position = 0;
+        }
+    };
+
+    static Seed random_seed() {
+        Seed seed;
+        std::random_device device;
+        for (size_t i = 0; i < seed.size(); i += 4) {
+            uint32_t value = device();
+            memcpy(&seed[i], &value, 4);
+        }
+        return seed;
+    }
+
+    //Uniform polynomial in evaluation format, expanded from the seed (one limb per thread)
+    static DCRTPoly expand(const std::shared_ptr<DCRTPoly::Params>& params, const Seed& seed, uint32_t stream) {
+        DCRTPoly a(params, Format::EVALUATION, true);
+        size_t limbs = params->GetParams().size();
+
+#pragma omp parallel for
+        for (size_t i = 0; i < limbs; i++) {
+            auto limb_params = params->GetParams()[i];
+            uint64_t q = limb_params->GetModulus().ConvertToInt();
+            uint64_t mask = (q & (q - 1)) == 0 ? q - 1 : (uint64_t(1) << (64 - __builtin_clzll(q))) - 1;
+            usint n = limb_params->GetRingDimension();
+
+            ChaChaStream prg(seed, stream, static_cast<uint32_t>(i));
+            NativeVector values(n, limb_params->GetModulus());
+            for (usint j = 0; j < n; j++) {
+                uint64_t v;
+                do {
+                    v = prg.next() & mask;
+                } while (v >= q);
+                values[j] = v;
+            }
+
+            NativePoly limb(limb_params, Format::EVALUATION, true);
+            limb.SetValues(std::move(values), Format::EVALUATION);
+            a.SetElementAtIndex(i, std::move(limb));
+        }
+
+        return a;
+    }
+
+    //Secret key over the basis of <params> (e.g. QP for the key-switching keys, or Q_l for a ciphertext)
+    static DCRTPoly extend_secret(const PrivateKey<DCRTPoly>& sk, const std::shared_ptr<DCRTPoly::Params>& params) {
+        DCRTPoly s = sk->GetPrivateElement().Clone();
+        s.SetFormat(Format::COEFFICIENT);
+
+        DCRTPoly extended(params, Format::COEFFICIENT, true);
+
+        for (size_t j = 0; j < params->GetParams().size(); j++) {
+            auto qj = params->GetParams()[j]->GetModulus();
+            if (j < s.GetNumOfElements() && s.GetElementAtIndex(j).GetModulus() == qj) {
+                extended.SetElementAtIndex(j, s.GetElementAtIndex(j));
+            } else {
+                NativePoly limb = s.GetElementAtIndex(0);
+                limb.SwitchModulus(qj, params->GetParams()[j]->GetRootOfUnity(), 0, 0);
+                extended.SetElementAtIndex(j, std::move(limb));
+            }
+        }
+
+        extended.SetFormat(Format::EVALUATION);
+        return extended;
+    }
+
+    static EvalKey<DCRTPoly> compress_key(const EvalKey<DCRTPoly>& key, const Seed& seed, const PrivateKey<DCRTPoly>& sk) {
+        auto relin = std::dynamic_pointer_cast<EvalKeyRelinImpl<DCRTPoly>>(key);
+        const vector<DCRTPoly>& a = relin->GetAVector();
+        const vector<DCRTPoly>& b = relin->GetBVector();
+
+        DCRTPoly s = extend_secret(sk, a[0].GetParams());
+
+        vector<DCRTPoly> b_seeded;
+        for (size_t d = 0; d < a.size(); d++) {
+            DCRTPoly a_seeded = expand(a[d].GetParams(), seed, static_cast<uint32_t>(d));
+            b_seeded.push_back(b[d] + (a[d] - a_seeded) * s);
+        }
+
+        auto compressed = std::make_shared<EvalKeyRelinImpl<DCRTPoly>>(key->GetCryptoContext());
+        compressed->SetKeyTag(key->GetKeyTag());
+        compressed->SetAVector(vector<DCRTPoly>());
+        compressed->SetBVector(std::move(b_seeded));
+
+        return compressed;
+    }
+
+    static EvalKey<DCRTPoly> expand_key(const EvalKey<DCRTPoly>& compressed, const Seed& seed) {
+        auto relin = std::dynamic_pointer_cast<EvalKeyRelinImpl<DCRTPoly>>(compressed);
+        const vector<DCRTPoly>& b = relin->GetBVector();
+
+        vector<DCRTPoly> a;
+        for (size_t d = 0; d < b.size(); d++) {
+            a.push_back(expand(b[d].GetParams(), seed, static_cast<uint32_t>(d)));
+        }
+
+        auto key = std::make_shared<EvalKeyRelinImpl<DCRTPoly>>(compressed->GetCryptoContext());
+        key->SetKeyTag(compressed->GetKeyTag());
+        key->SetAVector(std::move(a));
+        key->SetBVector(b);
+
+        return key;
+    }
+
+    template <typename T>
+    static void write_value(ostream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static T read_value(istream& in) {
+        T value;
+        in.read(reinterpret_cast<char*>(&value), sizeof(T));
+        return value;
+    }
+
+    static void write_key_record(ofstream& out, usint index, const EvalKey<DCRTPoly>& key, const PrivateKey<DCRTPoly>& sk) {
+        Seed seed = random_seed();
+
+        ostringstream stream;
+        Serial::Serialize(compress_key(key, seed, sk), stream, SerType::BINARY);
+        string data = stream.str();
+
+        write_value<uint32_t>(out, index);
+        out.write(reinterpret_cast<const char*>(seed.data()), seed.size());
+        write_value<uint64_t>(out, data.size());
+        out.write(data.data(), static_cast<streamsize>(data.size()));
+    }
+
+    static bool read_key_records(const string& filename, vector<pair<usint, EvalKey<DCRTPoly>>>& keys) {
+        ifstream in(filename, ios::in | ios::binary);
+        if (!in.is_open()) {
+            return false;
+        }
+
+        char magic[sizeof(KEYS_MAGIC)];
+        in.read(magic, sizeof(magic));
+        if (!in.good() || memcmp(magic, KEYS_MAGIC, sizeof(KEYS_MAGIC)) != 0) {
+            cerr << "\"" << filename << "\" is not a seed-compressed key file" << endl;
+            return false;
+        }
+
+        uint32_t count = read_value<uint32_t>(in);
+
+        vector<Seed> seeds(count);
+        keys.resize(count);
+
+        vector<string> data(count);
+
+        //Disk reads are sequential, decoding of the b parts and expansion of the a parts are parallel
+        for (uint32_t i = 0; i < count; i++) {
+            keys[i].first = read_value<uint32_t>(in);
+            in.read(reinterpret_cast<char*>(seeds[i].data()), seeds[i].size());
+
+            data[i].resize(read_value<uint64_t>(in));
+            in.read(&data[i][0], static_cast<streamsize>(data[i].size()));
+
+            if (!in.good()) {
+                cerr << "Could not read key " << i << " from \"" << filename << "\"" << endl;
+                return false;
+            }
+        }
+
+#pragma omp parallel for schedule(dynamic)
+        for (uint32_t i = 0; i < count; i++) {
+            istringstream stream(std::move(data[i]));
+            Serial::Deserialize(keys[i].second, stream, SerType::BINARY);
+            if (keys[i].second != nullptr) {
+                keys[i].second = expand_key(keys[i].second, seeds[i]);
+            }
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (keys[i].second == nullptr) {
+                cerr << "Could not decode key " << i << " from \"" << filename << "\"" << endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool serialize_keys(const string& filename, const KeyMap& keys, const PrivateKey<DCRTPoly>& sk) {
+        ofstream out(filename, ios::out | ios::binary);
+        if (!out.is_open()) {
+            return false;
+        }
+
+        out.write(KEYS_MAGIC, sizeof(KEYS_MAGIC));
+        write_value<uint32_t>(out, static_cast<uint32_t>(keys.size()));
+
+        for (const auto& [index, key] : keys) {
+            write_key_record(out, index, key, sk);
+        }
+
+        return out.good();
+    }
+
+    std::shared_ptr<KeyMap> deserialize_keys(const string& filename) {
+        vector<pair<usint, EvalKey<DCRTPoly>>> records;
+        if (!read_key_records(filename, records)) {
+            return nullptr;
+        }
+
+        auto keys = std::make_shared<KeyMap>();
+        for (auto& [index, key] : records) {
+            (*keys)[index] = key;
+        }
+
+        return keys;
+    }
+
+    bool serialize_mult_keys(const string& filename, const vector<EvalKey<DCRTPoly>>& keys, const PrivateKey<DCRTPoly>& sk) {
+        ofstream out(filename, ios::out | ios::binary);
+        if (!out.is_open()) {
+            return false;
+        }
+
+        out.write(KEYS_MAGIC, sizeof(KEYS_MAGIC));
+        write_value<uint32_t>(out, static_cast<uint32_t>(keys.size()));
+
+        for (size_t i = 0; i < keys.size(); i++) {
+            write_key_record(out, static_cast<usint>(i), keys[i], sk);
+        }
+
+        return out.good();
+    }
+
+    bool deserialize_mult_keys(const string& filename, vector<EvalKey<DCRTPoly>>& keys) {
+        vector<pair<usint, EvalKey<DCRTPoly>>> records;
+        if (!read_key_records(filename, records)) {
+            return false;
+        }
+
+        keys.clear();
+        for (auto& record : records) {
+            keys.push_back(record.second);
+        }
+
+        return true;
+    }
+
+    bool serialize_ciphertext(const string& filename, const Ciphertext<DCRTPoly>& c, const PrivateKey<DCRTPoly>& sk) {
+        ofstream out(filename, ios::out | ios::binary);
+        if (!out.is_open()) {
+            return false;
+        }
+
+        Seed seed = random_seed();
+
+        const vector<DCRTPoly>& elements = c->GetElements();
+        DCRTPoly a = expand(elements[1].GetParams(), seed, 0);
+        DCRTPoly s = extend_secret(sk, elements[1].GetParams());
+
+        Ciphertext<DCRTPoly> compressed = c->Clone();
+        compressed->SetElements({elements[0] + (elements[1] - a) * s});
+
+        ostringstream stream;
+        Serial::Serialize(compressed, stream, SerType::BINARY);
+        string data = stream.str();
+
+        out.write(CTXT_MAGIC, sizeof(CTXT_MAGIC));
+        out.write(reinterpret_cast<const char*>(seed.data()), seed.size());
+        write_value<uint64_t>(out, data.size());
+        out.write(data.data(), static_cast<streamsize>(data.size()));
+
+        return out.good();
+    }
+
+    bool deserialize_ciphertext(const string& filename, Ciphertext<DCRTPoly>& c) {
+        ifstream in(filename, ios::in | ios::binary);
+        if (!in.is_open()) {
+            return false;
+        }
+
+        char magic[sizeof(CTXT_MAGIC)];
+        in.read(magic, sizeof(magic));
+        if (!in.good() || memcmp(magic, CTXT_MAGIC, sizeof(CTXT_MAGIC)) != 0) {
+            cerr << "\"" << filename << "\" is not a seed-compressed ciphertext" << endl;
+            return false;
+        }
+
+        Seed seed;
+        in.read(reinterpret_cast<char*>(seed.data()), seed.size());
+
+        string data(read_value<uint64_t>(in), '\0');
+        in.read(&data[0], static_cast<streamsize>(data.size()));
+
+        istringstream stream(data);
+        Serial::Deserialize(c, stream, SerType::BINARY);
+
+        if (!in.good() || c == nullptr) {
+            return false;
+        }
+
+        DCRTPoly b = c->GetElements()[0];
+        DCRTPoly a = expand(b.GetParams(), seed, 0);
+        c->SetElements({std::move(b), std::move(a)});
+
+        return true;
+    }
+
+}
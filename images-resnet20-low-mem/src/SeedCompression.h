@@ -0,0 +1,38 @@
+#ifndef LOWMEMORYFHERESNET20_SEEDCOMPRESSION_H
+#define LOWMEMORYFHERESNET20_SEEDCOMPRESSION_H
+
+#include "openfhe.h"
+#include "ciphertext-ser.h"
+#include "key/key-ser.h"
+
+#include <array>
+#include <map>
+
+using namespace lbcrypto;
+using namespace std;
+
+/*
+ * Seed-compressed serialization of key-switching keys and secret-key encrypted ciphertexts.
+ *
+ * Both are pairs (b, a) with b + a * s known to the owner of s, and a uniformly random. Before writing, a is
+ * replaced by a' = PRG(seed) and b by b' = b + (a - a') * s, which is an equivalent key (or ciphertext) with the
+ * same noise: only b' and the 32 bytes seed are stored, and a' is expanded again on load, in parallel.
+ * The PRG is ChaCha20, one stream per (digit, RNS limb).
+ */
+namespace seeded {
+
+    using Seed = array<uint8_t, 32>;
+    using KeyMap = std::map<usint, EvalKey<DCRTPoly>>;
+
+    bool serialize_keys(const string& filename, const KeyMap& keys, const PrivateKey<DCRTPoly>& sk);
+    std::shared_ptr<KeyMap> deserialize_keys(const string& filename);
+
+    bool serialize_mult_keys(const string& filename, const vector<EvalKey<DCRTPoly>>& keys, const PrivateKey<DCRTPoly>& sk);
+    bool deserialize_mult_keys(const string& filename, vector<EvalKey<DCRTPoly>>& keys);
+
+    bool serialize_ciphertext(const string& filename, const Ciphertext<DCRTPoly>& c, const PrivateKey<DCRTPoly>& sk);
+    bool deserialize_ciphertext(const string& filename, Ciphertext<DCRTPoly>& c);
+
+}
+
+#endif //LOWMEMORYFHERESNET20_SEEDCOMPRESSION_H
@@ -0,0 +1,181 @@
+#include "Tracer.h"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <atomic>
+
+Tracer::Span::Span(Tracer& tracer, const char* name, const char* category, int level, int slots)
+        : tracer(tracer), name(name), category(category), level(level), slots(slots) {
+    if (!tracer.enabled) return;
+
+    if (tracer.count_here()) {
+        counted = true;
+        start_counts = tracer.counters.read();
+    }
+    start = chrono::steady_clock::now();
+}
+
+Tracer::Span::~Span() {
+    if (tracer.enabled) tracer.record(name, category, tracer.current_scope(), start, level, slots, counted ? &start_counts : nullptr);
+}
+
+bool Tracer::enable_counters() {
+    //Must be called before any OpenMP region, so that the pool threads inherit the counters
+    counting = counters.open();
+    if (counting) enabled = true;
+    return counting;
+}
+
+bool Tracer::count_here() const {
+    //Deltas read on OpenMP threads would overlap with the ones of the main thread
+    return counting && std::this_thread::get_id() == main_thread;
+}
+
+void Tracer::begin_scope(const string& name) {
+    //Scopes are tracked even when tracing is disabled, since the memory monitor attributes its samples to them
+    lock_guard<mutex> guard(lock);
+    open_scopes.emplace_back(scope, chrono::steady_clock::now());
+    open_scope_counts.push_back(count_here() ? counters.read() : PerfCounters::Values{});
+    scope = scope.empty() ? name : scope + "/" + name;
+}
+
+void Tracer::end_scope() {
+    if (open_scopes.empty()) return;
+
+    if (enabled) record("scope", "scope", current_scope(), open_scopes.back().second, -1, -1,
+                        count_here() ? &open_scope_counts.back() : nullptr);
+
+    lock_guard<mutex> guard(lock);
+    scope = open_scopes.back().first;
+    open_scopes.pop_back();
+    open_scope_counts.pop_back();
+}
+
+string Tracer::current_scope() {
+    lock_guard<mutex> guard(lock);
+    return scope;
+}
+
+int Tracer::thread_id() {
+    static atomic<int> next_id(0);
+    thread_local int id = next_id++;
+    return id;
+}
+
+void Tracer::record(const char* name, const char* category, const string& event_scope, chrono::steady_clock::time_point start, int level, int slots,
+                    const PerfCounters::Values* start_counts) {
+    auto end = chrono::steady_clock::now();
+
+    Event event{name, category, event_scope,
+                chrono::duration_cast<chrono::microseconds>(start - origin).count(),
+                chrono::duration_cast<chrono::microseconds>(end - start).count(),
+                level, slots, thread_id(), start_counts != nullptr, {}};
+
+    if (start_counts != nullptr) {
+        PerfCounters::Values end_counts = counters.read();
+        for (int i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+            event.counts[i] = end_counts[i] - (*start_counts)[i];
+        }
+    }
+
+    lock_guard<mutex> guard(lock);
+    events.push_back(std::move(event));
+}
+
+void Tracer::write_chrome_trace(const string& filename) {
+    ofstream out(filename);
+    if (!out.is_open()) {
+        cerr << "Could not write the trace in \"" << filename << "\"" << endl;
+        return;
+    }
+
+    lock_guard<mutex> guard(lock);
+
+    out << "{\"traceEvents\":[" << endl;
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event& e = events[i];
+        //Scopes are shown with their own name, operations with the operation name
+        string name = string(e.category) == "scope" ? e.scope : e.name;
+
+        out << "{\"name\":\"" << name << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+            << ",\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us
+            << ",\"args\":{\"scope\":\"" << e.scope << "\",\"level\":" << e.level << ",\"slots\":" << e.slots;
+        if (e.counted) {
+            for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++) {
+                out << ",\"" << PerfCounters::name(c) << "\":" << e.counts[c];
+            }
+        }
+        out << "}}"
+            << (i + 1 < events.size() ? "," : "") << endl;
+    }
+    out << "]}" << endl;
+
+    cout << "Trace with " << events.size() << " events written in \"" << filename << "\"" << endl;
+}
+
+vector<Tracer::Event> Tracer::recorded_events() {
+    lock_guard<mutex> guard(lock);
+    return events;
+}
+
+void Tracer::print_summary() {
+    struct Total {
+        int count = 0;
+        int64_t duration_us = 0;
+        int counted = 0;
+        PerfCounters::Values counts{};
+    };
+
+    //Operations are grouped by their top-level scope (the layer) and name, layers are the top-level scopes
+    map<pair<string, string>, Total> totals;
+
+    {
+        lock_guard<mutex> guard(lock);
+        for (const Event& e : events) {
+            bool is_scope = string(e.category) == "scope";
+            if (is_scope && e.scope.find('/') != string::npos) continue;
+
+            string layer = e.scope.substr(0, e.scope.find('/'));
+            Total& total = totals[{layer, is_scope ? "(whole scope)" : e.name}];
+            total.count++;
+            total.duration_us += e.duration_us;
+
+            if (e.counted) {
+                total.counted++;
+                for (int c = 0; c < PerfCounters::NUM_COUNTERS; c++) total.counts[c] += e.counts[c];
+            }
+        }
+    }
+
+    cout << left << setw(16) << "Scope" << setw(28) << "Operation" << right << setw(10) << "Count"
+         << setw(14) << "Total (ms)" << setw(14) << "Mean (ms)";
+    if (counting) {
+        cout << setw(8) << "IPC" << setw(14) << "LLC miss/kI" << setw(14) << "dTLB miss/kI" << setw(10) << "GB/s";
+    }
+    cout << endl;
+
+    for (const auto& [key, total] : totals) {
+        cout << left << setw(16) << (key.first.empty() ? "-" : key.first) << setw(28) << key.second << right
+             << setw(10) << total.count
+             << setw(14) << fixed << setprecision(1) << total.duration_us / 1000.0
+             << setw(14) << total.duration_us / 1000.0 / total.count;
+
+        if (counting && total.counted > 0) {
+            double cycles = total.counts[PerfCounters::CYCLES];
+            double kilo_instructions = total.counts[PerfCounters::INSTRUCTIONS] / 1000.0;
+
+            //Each LLC miss moves a 64 bytes line from memory
+            double bandwidth = total.duration_us > 0 ? total.counts[PerfCounters::LLC_MISSES] * 64.0 / (total.duration_us * 1000.0) : 0;
+
+            cout << setprecision(2)
+                 << setw(8) << (cycles > 0 ? kilo_instructions * 1000.0 / cycles : 0)
+                 << setw(14) << (kilo_instructions > 0 ? total.counts[PerfCounters::LLC_MISSES] / kilo_instructions : 0)
+                 << setw(14) << (kilo_instructions > 0 ? total.counts[PerfCounters::DTLB_MISSES] / kilo_instructions : 0)
+                 << setw(10) << bandwidth;
+        }
+        cout << endl;
+    }
+    cout.unsetf(ios::fixed);
+}
@@ -0,0 +1,91 @@
+#ifndef LOWMEMORYFHERESNET20_TRACER_H
+#define LOWMEMORYFHERESNET20_TRACER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <thread>
+
+#include "PerfCounters.h"
+
+using namespace std;
+
+/*
+ * Records the homomorphic operations (rotations, multiplications, bootstrapping, ReLU, encoding, key loading...)
+ * with start/end, level, slots, thread and the layer/block scope they belong to.
+ * The trace can be exported in the Chrome trace format (chrome://tracing, ui.perfetto.dev) and summarized by scope
+ * and operation. When disabled, a span only checks a flag.
+ *
+ * With hardware counters enabled, the spans and scopes of the main thread also record the counter deltas (which
+ * include the OpenMP threads), so that each op type and layer can be classified as compute or memory bound.
+ */
+class Tracer {
+public:
+    struct Event {
+        const char* name;
+        const char* category;
+        string scope;
+        int64_t start_us;
+        int64_t duration_us;
+        int level;
+        int slots;
+        int thread;
+        bool counted;
+        PerfCounters::Values counts;
+    };
+
+    //A single operation, recorded when it goes out of scope
+    class Span {
+    public:
+        Span(Tracer& tracer, const char* name, const char* category, int level = -1, int slots = -1);
+        ~Span();
+
+    private:
+        Tracer& tracer;
+        const char* name;
+        const char* category;
+        int level;
+        int slots;
+        chrono::steady_clock::time_point start;
+        bool counted = false;
+        PerfCounters::Values start_counts;
+    };
+
+    bool enabled = false;
+
+    //Enables tracing with hardware counters, false if they are not available
+    bool enable_counters();
+
+    void write_chrome_trace(const string& filename);
+    vector<Event> recorded_events();
+    void print_summary();
+
+    /*
+     * Every operation between begin_scope and end_scope is attributed to the scope. Scopes are opened by the
+     * main thread only, and nested scopes are joined with "/" (e.g. "Layer2/Block 1")
+     */
+    void begin_scope(const string& name);
+    void end_scope();
+    string current_scope();
+
+private:
+    vector<Event> events;
+    string scope;
+    vector<pair<string, chrono::steady_clock::time_point>> open_scopes;
+    vector<PerfCounters::Values> open_scope_counts;
+    mutex lock;
+    chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+
+    PerfCounters counters;
+    bool counting = false;
+    std::thread::id main_thread = std::this_thread::get_id();
+
+    bool count_here() const;
+    void record(const char* name, const char* category, const string& event_scope, chrono::steady_clock::time_point start, int level, int slots,
+                const PerfCounters::Values* start_counts = nullptr);
+    static int thread_id();
+};
+
+
+#endif //LOWMEMORYFHERESNET20_TRACER_H
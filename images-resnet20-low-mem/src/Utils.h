@@ -6,8 +6,11 @@
 #define LOWMEMORYFHERESNET20_UTILS_H
 
 #include <iostream>
+#include <malloc.h>
 #include <openfhe.h>
 
+#include "WeightPack.h"
+
 #define YELLOW_TEXT "\033[1;33m"
 #define RESET_COLOR "\033[0m"
 
@@ -86,8 +89,42 @@ namespace utils {
         }
     }
 
+    /*
+     * Limbs of 2^16 words (512 KB) are allocated and freed by every homomorphic operation. With a fixed mmap threshold
+     * above their size they are recycled from the malloc bins, instead of being mapped (and zeroed by page faults)
+     * each time. The top of each arena keeps at most 16 free limbs (8 MB), the rest goes back to the system as soon as
+     * it is freed, and the explicit trims between phases also return the free pages inside the heaps.
+     */
+    static inline void configure_limb_recycling() {
+        mallopt(M_MMAP_THRESHOLD, 64 * 1024 * 1024);
+        mallopt(M_TRIM_THRESHOLD, 16 * 512 * 1024);
+    }
+
+    /*
+     * Keys and bootstrapping precomputations are freed between phases, so while they are allocated the threshold goes
+     * below the size of a limb: each limb gets its own mapping, which is unmapped (not kept in the heap) when freed.
+     */
+    struct KeyAllocation {
+        KeyAllocation() {
+            mallopt(M_MMAP_THRESHOLD, 256 * 1024);
+        }
+
+        ~KeyAllocation() {
+            configure_limb_recycling();
+        }
+
+        KeyAllocation(const KeyAllocation&) = delete;
+        KeyAllocation& operator=(const KeyAllocation&) = delete;
+    };
+
     static inline vector<double> read_values_from_file(const string& filename, double scale = 1) {
         vector<double> values;
+
+        //Compact weights, when selected and available, replace the text ones
+        if (!weightpack::format.empty() &&
+            weightpack::read(weightpack::compact_filename(filename, weightpack::format), scale, values)) {
+            return values;
+        }
         ifstream file(filename);
 
         if (!file.is_open()) {
@@ -0,0 +1,151 @@
+#include "WeightPack.h"
+#include "Utils.h"
+
+#include <filesystem>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+
+namespace weightpack {
+
+    struct Header {
+        char magic[4];
+        uint32_t count;
+        float tensor_scale;
+    };
+
+    static const char MAGIC_F32[4] = {'W', 'F', '3', '2'};
+    static const char MAGIC_BF16[4] = {'W', 'B', '1', '6'};
+
+    bool valid_format(const string& format) {
+        return format == "f32" || format == "bf16";
+    }
+
+    string compact_filename(const string& filename, const string& format) {
+        const string text_extension = ".bin";
+        if (filename.size() <= text_extension.size() ||
+            filename.compare(filename.size() - text_extension.size(), text_extension.size(), text_extension) != 0) {
+            return "";
+        }
+
+        return filename.substr(0, filename.size() - text_extension.size()) + "." + format;
+    }
+
+    //Round to nearest even, as the hardware conversions do
+    static uint16_t to_bf16(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        bits += 0x7FFF + ((bits >> 16) & 1);
+        return static_cast<uint16_t>(bits >> 16);
+    }
+
+    static float from_bf16(uint16_t value) {
+        uint32_t bits = static_cast<uint32_t>(value) << 16;
+        float widened;
+        memcpy(&widened, &bits, sizeof(widened));
+        return widened;
+    }
+
+    bool read(const string& filename, double scale, vector<double>& values) {
+        if (filename.empty()) return false;
+
+        ifstream file(filename, ios::binary);
+        if (!file.is_open()) return false;
+
+        Header header;
+        if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+
+        bool bf16 = memcmp(header.magic, MAGIC_BF16, 4) == 0;
+        if (!bf16 && memcmp(header.magic, MAGIC_F32, 4) != 0) {
+            cerr << "Wrong compact weights file: " << filename << endl;
+            return false;
+        }
+
+        //Decoded aside, so that a truncated file leaves values as it was for the text fallback
+        vector<double> decoded(header.count);
+        const double factor = static_cast<double>(header.tensor_scale) * scale;
+
+        if (bf16) {
+            vector<uint16_t> data(header.count);
+            if (!file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(uint16_t))) return false;
+
+#pragma omp simd
+            for (size_t i = 0; i < data.size(); i++) {
+                decoded[i] = static_cast<double>(from_bf16(data[i])) * factor;
+            }
+        } else {
+            vector<float> data(header.count);
+            if (!file.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float))) return false;
+
+#pragma omp simd
+            for (size_t i = 0; i < data.size(); i++) {
+                decoded[i] = static_cast<double>(data[i]) * factor;
+            }
+        }
+
+        values.swap(decoded);
+        return true;
+    }
+
+    //Returns the largest absolute error of the conversion
+    static double write(const string& filename, const string& format, const vector<double>& values) {
+        double max_abs = 0;
+        for (double value : values) max_abs = max(max_abs, abs(value));
+
+        Header header;
+        memcpy(header.magic, format == "bf16" ? MAGIC_BF16 : MAGIC_F32, 4);
+        header.count = static_cast<uint32_t>(values.size());
+        header.tensor_scale = max_abs > 0 ? static_cast<float>(max_abs) : 1.0f;
+
+        ofstream file(filename, ios::binary);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        double max_error = 0;
+
+        if (format == "bf16") {
+            vector<uint16_t> data(values.size());
+            for (size_t i = 0; i < values.size(); i++) {
+                data[i] = to_bf16(static_cast<float>(values[i] / header.tensor_scale));
+                max_error = max(max_error, abs(values[i] - from_bf16(data[i]) * static_cast<double>(header.tensor_scale)));
+            }
+            file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(uint16_t));
+        } else {
+            vector<float> data(values.size());
+            for (size_t i = 0; i < values.size(); i++) {
+                data[i] = static_cast<float>(values[i] / header.tensor_scale);
+                max_error = max(max_error, abs(values[i] - data[i] * static_cast<double>(header.tensor_scale)));
+            }
+            file.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
+        }
+
+        if (!file) {
+            cerr << "Could not write " << filename << endl;
+            exit(1);
+        }
+
+        return max_error;
+    }
+
+    int convert_folder(const string& folder, const string& format, double& max_error) {
+        int converted = 0;
+        max_error = 0;
+
+        for (const auto& entry : filesystem::directory_iterator(folder)) {
+            string filename = entry.path().string();
+            string compact = compact_filename(filename, format);
+            if (compact.empty()) continue;
+
+            //The text values, never the compact ones
+            string current_format = weightpack::format;
+            weightpack::format = "";
+            vector<double> values = utils::read_values_from_file(filename);
+            weightpack::format = current_format;
+
+            max_error = max(max_error, write(compact, format, values));
+            converted++;
+        }
+
+        return converted;
+    }
+
+}
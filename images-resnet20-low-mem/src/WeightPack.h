@@ -0,0 +1,35 @@
+#ifndef LOWMEMORYFHERESNET20_WEIGHTPACK_H
+#define LOWMEMORYFHERESNET20_WEIGHTPACK_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Compact binary weights, stored next to the text ones (X.bin -> X.f32 or X.bf16).
+ *
+ * Layout: [magic (4 bytes, "WF32" or "WB16")] [count (uint32)] [tensor scale (float)] [values]
+ * Values are divided by the tensor scale (the largest absolute value of the tensor), so that bfloat16 keeps its
+ * 8 bits of mantissa for the values actually used. On read they are widened to double and multiplied back by the
+ * tensor scale, in a loop vectorized by the compiler.
+ */
+namespace weightpack {
+
+    //"f32" or "bf16", empty to read the text weights
+    inline string format;
+
+    bool valid_format(const string& format);
+
+    //Empty if the file is not a text weights file
+    string compact_filename(const string& filename, const string& format);
+
+    //False if the compact file is missing or corrupted, values is only modified on success
+    bool read(const string& filename, double scale, vector<double>& values);
+
+    //Converts every .bin file of the folder, returns the number of files converted and the largest conversion error
+    int convert_folder(const string& folder, const string& format, double& max_error);
+
+}
+
+#endif //LOWMEMORYFHERESNET20_WEIGHTPACK_H
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <omp.h>
 
 #include "FHEController.h"
 
@@ -15,20 +17,46 @@ void check_arguments(int argc, char *argv[]);
 vector<double> read_image(const char *filename);
 
 void executeResNet20();
+void executePackingBenchmark();
+void executeWorkers();
+void executeWeightsVerification();
 
-Ctxt initial_layer(const Ctxt& in);
-Ctxt layer1(const Ctxt& in);
+Ctxt initial_layer(const Ctxt& in, double output_scale = 1);
+Ctxt layer1(Ctxt in);
 Ctxt layer2(const Ctxt& in);
 Ctxt layer3(const Ctxt& in);
 Ctxt final_layer(const Ctxt& in);
 
 FHEController controller;
 
+/*
+ * Each block adds its shortcut multiplied by the scale of its last convolution. The factor is folded into the ReLU
+ * producing the shortcut (output_scale) and removed from the weights of the convolution also reading it (input_scale),
+ * so residual additions need no multiplication.
+ */
+const double layer1_shortcut_scale = 0.52;
+
 int generate_context;
 string input_filename;
 int verbose;
 bool test;
 bool plain;
+bool full_slot;
+bool benchmark_packing;
+bool benchmark_seeded;
+bool benchmark_huge_pages;
+int workers;
+vector<string> input_filenames;
+string checkpoint_suffix;
+bool checkpoints = true;
+bool resume;
+string trace_filename;
+string convert_weights_format;
+bool verify_weights;
+vector<double> last_output;
+string timings_filename;
+double key_budget_mb = -1;
+bool monitor_memory;
 
 /*
  * TODO:
@@ -36,15 +64,42 @@ bool plain;
  */
 
 int main(int argc, char *argv[]) {
+    configure_limb_recycling();
+
     //TODO: possibile che il bootstrap a 8192 ci metta lo stesso tempo? indaga
 
     check_arguments(argc, argv);
 
+    //A thread does not survive fork, so with workers each of them starts its own monitor
+    if (monitor_memory && workers <= 1) {
+        controller.memory.start();
+    }
+
     if (test) {
         controller.test_context();
         exit(0);
     }
 
+    if (controller.dry_run) {
+        //Nothing is encrypted, so nothing is checkpointed
+        controller.load_parameters(verbose > 1);
+        checkpoints = false;
+        resume = false;
+        controller.use_seeded_keys = false;
+
+        executeResNet20();
+        controller.cost_model.print_report();
+        if (key_budget_mb >= 0) controller.write_key_plan(key_budget_mb);
+        exit(0);
+    }
+
+    if (!convert_weights_format.empty()) {
+        double max_error;
+        int converted = weightpack::convert_folder("../weights", convert_weights_format, max_error);
+        cout << "Converted " << converted << " weight files to " << convert_weights_format << ", largest error: " << max_error << endl;
+        exit(0);
+    }
+
     if (generate_context == -1) {
         cerr << "You either have to use the argument \"generate_keys\" or \"load_keys\"!\nIf it is your first time, you could try "
                 "with \"./LowMemoryFHEResNet20 generate_keys 1\"\nCheck the README.md.\nAborting. :-(" << endl;
@@ -76,57 +131,101 @@ int main(int argc, char *argv[]) {
         if (verbose > 1) cout << "(It may take a while, depending on the machine)" << endl;
 
 
-        controller.generate_bootstrapping_and_rotation_keys({1, -1, 32, -32, -1024},
-                                                            16384,
-                                                            true,
-                                                            "rotations-layer1.bin");
-        //After each serialization I release and re-load the context, otherwise OpenFHE gives a weird error (something
-        //like "4kb missing"), but I have no time to investigate :D
-        if (verbose > 1) cout << "1/6 done." << endl;
-        controller.clear_context(16384);
-        controller.load_context(false);
-        controller.generate_rotation_keys({1, 2, 4, 8, 64-16, -(1024 - 256), (1024 - 256) * 32, -8192},
-                                          true,
-                                          "rotations-layer2-downsample.bin");
-        if (verbose > 1) cout << "2/6 done." << endl;
-        controller.clear_context(0);
-        controller.load_context(false);
-        controller.generate_bootstrapping_and_rotation_keys({1, -1, 16, -16, -256},
-                                          8192,
-                                          true,
-                                          "rotations-layer2.bin");
-        if (verbose > 1) cout << "3/6 done." << endl;
-        controller.clear_context(8192);
-        controller.load_context(false);
-        controller.generate_rotation_keys({1, 2, 4, 32 - 8, -(256 - 64), (256 - 64) * 64, -4096},
-                                          true,
-                                          "rotations-layer3-downsample.bin");
-        if (verbose > 1) cout << "4/6 done." << endl;
-        controller.clear_context(0);
-        controller.load_context(false);
-        controller.generate_bootstrapping_and_rotation_keys({1, -1, 8, -8, -64},
-                                          4096,
-                                          true,
-                                          "rotations-layer3.bin");
-        if (verbose > 1)cout << "5/6 done." << endl;
-        controller.clear_context(4096);
-        controller.load_context(false);
-        controller.generate_rotation_keys({1, 2, 4, 8, 16, 32, -15, 64, 128, 256, 512, 1024, 2048}, true, "rotations-finallayer.bin");
-        if (verbose > 1) cout << "6/6 done!" << endl;
-
-        controller.clear_context(0);
-        controller.load_context(false);
+        //Keys are generated in a single pass, and each set is written as soon as it is ready
+        //The key sets planned by a dry run and the level budgets of the bootstrapping policy, when the parameters folder has them
+        controller.load_bootstrap_policy();
+        controller.generate_keys_pipeline(controller.planned_key_phases(), verbose > 1);
+
+        controller.close_key_store();
 
         cout << "Context created correctly." << endl;
         exit(0);
 
     } else {
+        //The OpenMP thread pool does not survive fork, so the host process loads everything with a single thread
+        if (workers > 1) omp_set_num_threads(1);
+
         controller.load_context(verbose > 1);
     }
 
+    if (benchmark_huge_pages) {
+        controller.benchmark_huge_pages("rotations-layer1.bin");
+        exit(0);
+    }
+
+    if (benchmark_seeded) {
+        controller.benchmark_seeded_keys("rotations-layer1.bin");
+        exit(0);
+    }
+
+    if (benchmark_packing) {
+        executePackingBenchmark();
+        exit(0);
+    }
+
+    if (verify_weights) {
+        executeWeightsVerification();
+        exit(0);
+    }
+
+    if (workers > 1) {
+        executeWorkers();
+        exit(0);
+    }
+
     executeResNet20();
 }
 
+void executeWorkers() {
+    /*
+     * The keys of all the phases are loaded once, then each worker is forked: worker processes share the key pages
+     * with the host (copy-on-write, and never written), so N workers need the memory of a single key set.
+     */
+    controller.host_keys({"rotations-layer1.bin", "rotations-layer2-downsample.bin", "rotations-layer2.bin",
+                          "rotations-layer3-downsample.bin", "rotations-layer3.bin"}, verbose > 1);
+
+    int threads = omp_get_num_procs() / workers;
+    vector<pid_t> children;
+
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            cerr << "Could not fork worker " << i << endl;
+            exit(1);
+        }
+
+        if (pid == 0) {
+            if (!input_filenames.empty()) {
+                input_filename = input_filenames[i % input_filenames.size()];
+            }
+            checkpoint_suffix = "-worker" + to_string(i);
+            omp_set_num_threads(max(threads, 1));
+
+            if (monitor_memory) {
+                controller.memory.start();
+            }
+
+            executeResNet20();
+            exit(0);
+        }
+
+        children.push_back(pid);
+    }
+
+    int failed = 0;
+    for (pid_t pid : children) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+
+    if (failed > 0) {
+        cerr << failed << " of " << workers << " workers failed" << endl;
+        exit(1);
+    }
+}
+
 void executeResNet20() {
     if (verbose >= 0) cout << "Encrypted ResNet20 classification started." << endl;
 
@@ -147,82 +246,241 @@ void executeResNet20() {
         if (verbose >= 0) cout << "I am going to encrypt and classify " << GREEN_TEXT<< input_filename << RESET_COLOR << "." << endl;
     }
 
-    vector<double> input_image = read_image(input_filename.c_str());
+    //Number of layers whose output is already in a checkpoint
+    int completed_layers = 0;
+    if (resume) {
+        for (int layer = 3; layer >= 1 && completed_layers == 0; layer--) {
+            if (controller.has_checkpoint("layer" + to_string(layer) + checkpoint_suffix)) completed_layers = layer;
+        }
+        if (verbose >= 0 && completed_layers > 0) cout << "Resuming after layer " << completed_layers << "." << endl;
+    }
 
-    Ctxt in = controller.encrypt(input_image, controller.circuit_depth - 4 - get_relu_depth(controller.relu_degree));
+    auto start = start_time();
 
-    controller.load_bootstrapping_and_rotation_keys("rotations-layer1.bin", 16384, verbose > 1);
+    if (completed_layers < 1) {
+        vector<double> input_image = read_image(input_filename.c_str());
+
+        Ctxt in;
+
+        if (controller.use_seeded_keys) {
+            //The client sends the seed-compressed input, the server expands it
+            controller.serialize_input_seeded(input_image, controller.circuit_depth - 4 - get_relu_depth(controller.relu_degree), "../checkpoints/input" + checkpoint_suffix + ".seeded");
+            in = controller.deserialize_input_seeded("../checkpoints/input" + checkpoint_suffix + ".seeded");
+        } else {
+            in = controller.encrypt(input_image, controller.circuit_depth - 4 - get_relu_depth(controller.relu_degree));
+        }
 
-    if (print_bootstrap_precision){
-        controller.bootstrap_precision(controller.encrypt(input_image, controller.circuit_depth - 2));
+        controller.load_bootstrapping_and_rotation_keys("rotations-layer1.bin", 16384, verbose > 1);
+
+        if (print_bootstrap_precision){
+            controller.bootstrap_precision(controller.encrypt(input_image, controller.circuit_depth - 2));
+        }
+
+        start = start_time();
+
+        controller.tracer.begin_scope("Initial");
+        firstLayer = initial_layer(in, layer1_shortcut_scale);
+        controller.tracer.end_scope();
+        if (print_intermediate_values) controller.print(firstLayer, 16384, "Initial layer: ");
+
+        /*
+         * Layer 1: 16 channels of 32x32
+         */
+        auto startLayer = start_time();
+        controller.tracer.begin_scope("Layer1");
+        resLayer1 = layer1(std::move(firstLayer));
+        controller.tracer.end_scope();
+        //Checkpoints are written in background, layer 2 starts with a bootstrapping so it needs no levels
+        if (checkpoints) controller.save_checkpoint(resLayer1, "layer1" + checkpoint_suffix, 0);
+        if (print_intermediate_values) controller.print(resLayer1, 16384, "Layer 1: ");
+        if (verbose > 0) print_duration(startLayer, "Layer 1 took:");
+        controller.memory.report("Layer 1", FHEController::ciphertext_bytes(resLayer1));
+    } else if (completed_layers == 1) {
+        resLayer1 = controller.load_checkpoint("layer1" + checkpoint_suffix);
+        controller.load_bootstrapping_and_rotation_keys("rotations-layer1.bin", 16384, verbose > 1);
     }
 
-    auto start = start_time();
+    /*
+     * Layer 2: 32 channels of 16x16
+     */
+    if (completed_layers < 2) {
+        auto startLayer = start_time();
+        controller.tracer.begin_scope("Layer2");
+        resLayer2 = layer2(resLayer1);
+        controller.tracer.end_scope();
+        if (checkpoints) controller.save_checkpoint(resLayer2, "layer2" + checkpoint_suffix, 0);
+        if (print_intermediate_values) controller.print(resLayer2, 8192, "Layer 2: ");
+        if (verbose > 0) print_duration(startLayer, "Layer 2 took:");
+        controller.memory.report("Layer 2", FHEController::ciphertext_bytes(resLayer2));
+    } else if (completed_layers == 2) {
+        resLayer2 = controller.load_checkpoint("layer2" + checkpoint_suffix);
+        controller.load_bootstrapping_and_rotation_keys("rotations-layer2.bin", 8192, verbose > 1);
+        controller.num_slots = 8192;
+    }
 
-    firstLayer = initial_layer(in);
-    if (print_intermediate_values) controller.print(firstLayer, 16384, "Initial layer: ");
-  
     /*
-     * Layer 1: 16 channels of 32x32
+     * Layer 3: 64 channels of 8x8
      */
-    auto startLayer = start_time();
-    resLayer1 = layer1(firstLayer);
-    Serial::SerializeToFile("../checkpoints/layer1.bin", resLayer1, SerType::BINARY);
-    if (print_intermediate_values) controller.print(resLayer1, 16384, "Layer 1: ");
-    if (verbose > 0) print_duration(startLayer, "Layer 1 took:");
+    if (completed_layers < 3) {
+        auto startLayer = start_time();
+        controller.tracer.begin_scope("Layer3");
+        resLayer3 = layer3(resLayer2);
+        controller.tracer.end_scope();
+        if (checkpoints) controller.save_checkpoint(resLayer3, "layer3" + checkpoint_suffix, 1);
+        if (print_intermediate_values) controller.print(resLayer3, 4096, "Layer 3: ");
+        if (verbose > 0) print_duration(startLayer, "Layer 3 took:");
+        controller.memory.report("Layer 3", FHEController::ciphertext_bytes(resLayer3));
+    } else {
+        resLayer3 = controller.load_checkpoint("layer3" + checkpoint_suffix);
+        controller.load_bootstrapping_and_rotation_keys("rotations-layer3.bin", 4096, verbose > 1);
+        controller.num_slots = 4096;
+    }
+
+    controller.tracer.begin_scope("Final");
+    finalRes = final_layer(resLayer3);
+    controller.tracer.end_scope();
+    if (checkpoints) controller.save_checkpoint(finalRes, "finalres" + checkpoint_suffix, 0);
+    controller.wait_checkpoint();
 
+    if (!trace_filename.empty()) {
+        controller.tracer.write_chrome_trace(trace_filename);
+    }
+
+    if (controller.tracer.enabled) {
+        controller.tracer.print_summary();
+    }
+
+    controller.memory.print_summary();
+    controller.memory.stop();
+
+    if (!timings_filename.empty()) {
+        controller.save_timings(timings_filename);
+    }
+
+    if (controller.bootstrap_required_bits > 0) {
+        controller.write_bootstrap_policy();
+    }
+
+    if (verbose > 0) print_duration_yellow(start, "The evaluation of the whole circuit took: ");
+}
+
+void executeWeightsVerification() {
     /*
-     * Layer 2: 32 channels of 16x16
+     * The same input is classified with the text weights and with the compact ones: the class must not change.
+     * The outputs also differ by the CKKS noise of two different encryptions, so only the class is checked.
      */
-    startLayer = start_time();
-    Serial::DeserializeFromFile("../checkpoints/layer1.bin", resLayer1, SerType::BINARY);
-    resLayer2 = layer2(resLayer1);
-    Serial::SerializeToFile("../checkpoints/layer2.bin", resLayer2, SerType::BINARY);
-    if (print_intermediate_values) controller.print(resLayer2, 8192, "Layer 2: ");
-    if (verbose > 0) print_duration(startLayer, "Layer 2 took:");
+    if (weightpack::format.empty()) {
+        cerr << "Select the compact weights to verify with \"weights f32\" or \"weights bf16\"" << endl;
+        exit(1);
+    }
+
+    string compact_format = weightpack::format;
+    int slots = controller.num_slots;
+
+    weightpack::format = "";
+    checkpoint_suffix = "-text";
+    executeResNet20();
+    vector<double> reference = last_output;
+
+    //The next inference starts again from the first layer
+    controller.clear_bootstrapping_and_rotation_keys(4096);
+    controller.num_slots = slots;
+
+    weightpack::format = compact_format;
+    checkpoint_suffix = "-" + compact_format;
+    executeResNet20();
+
+    int reference_class = distance(reference.begin(), max_element(reference.begin(), reference.end()));
+    int compact_class = distance(last_output.begin(), max_element(last_output.begin(), last_output.end()));
+
+    double max_difference = 0;
+    for (size_t i = 0; i < reference.size(); i++) {
+        max_difference = max(max_difference, abs(reference[i] - last_output[i]));
+    }
+
+    cout << "Largest output difference: " << max_difference << endl;
+
+    if (reference_class != compact_class) {
+        cout << RED_TEXT << "The " << compact_format << " weights change the class from " << utils::get_class(reference_class)
+             << " to " << utils::get_class(compact_class) << RESET_COLOR << endl;
+        exit(1);
+    }
+
+    cout << GREEN_TEXT << "The " << compact_format << " weights give the same class (" << utils::get_class(compact_class) << ")" << RESET_COLOR << endl;
+}
 
+void executePackingBenchmark() {
     /*
-     * Layer 2: 64 channels of 8x8
+     * Compares the first block of layer 2 (the 16 -> 32 channels convolutions + downsampling) with the
+     * 16384 slots layout and with the full-slot layout, on the same input. Outputs should be the same.
      */
-    startLayer = start_time();
-    Serial::DeserializeFromFile("../checkpoints/layer2.bin", resLayer2, SerType::BINARY);
-    resLayer3 = layer3(resLayer2);
-    Serial::SerializeToFile("../checkpoints/layer3.bin", resLayer3, SerType::BINARY);
-    if (print_intermediate_values) controller.print(resLayer3, 4096, "Layer 3: ");
-    if (verbose > 0) print_duration(startLayer, "Layer 3 took:");
+    if (input_filename.empty()) {
+        input_filename = "../inputs/luis.png";
+    }
 
+    cout << "Benchmarking the packing of the convolutions on " << GREEN_TEXT << input_filename << RESET_COLOR << "." << endl;
 
-    Serial::DeserializeFromFile("../checkpoints/layer3.bin", resLayer3, SerType::BINARY);
-    finalRes = final_layer(resLayer3);
-    Serial::SerializeToFile("../checkpoints/finalres.bin", finalRes, SerType::BINARY);
+    vector<double> input_image = read_image(input_filename.c_str());
 
-    if (verbose > 0) print_duration_yellow(start, "The evaluation of the whole circuit took: ");
+    controller.load_bootstrapping_and_rotation_keys("rotations-layer1.bin", 16384, verbose > 1);
+
+    Ctxt in = controller.bootstrap(initial_layer(controller.encrypt(input_image, controller.circuit_depth - 4 - get_relu_depth(controller.relu_degree))));
+
+    auto start = start_time();
+    vector<Ctxt> res_sx = controller.convbn1632sx(in, 4, 1, 0.57, verbose > 1);
+    vector<Ctxt> res_dx = controller.convbn1632dx(in, 4, 1, 0.40, verbose > 1);
+    print_duration(start, "Convolutions, 16384 slots layout");
+
+    auto start_full = start_time();
+    Ctxt res_sx_full = controller.convbn1632sxV2(in, 4, 1, 0.57, verbose > 1);
+    Ctxt res_dx_full = controller.convbn1632dxV2(in, 4, 1, 0.40, verbose > 1);
+    print_duration(start_full, "Convolutions, full-slot layout");
+
+    controller.clear_bootstrapping_and_rotation_keys(16384);
+    controller.load_rotation_keys("rotations-layer2-downsample.bin", verbose > 1);
+
+    start = start_time();
+    Ctxt down_sx = controller.downsample1024to256(res_sx[0], res_sx[1]);
+    Ctxt down_dx = controller.downsample1024to256(res_dx[0], res_dx[1]);
+    print_duration(start, "Downsampling, 16384 slots layout");
+
+    start_full = start_time();
+    Ctxt down_sx_full = controller.downsample1024to256(res_sx_full);
+    Ctxt down_dx_full = controller.downsample1024to256(res_dx_full);
+    print_duration(start_full, "Downsampling, full-slot layout");
+
+    controller.num_slots = 8192;
+
+    cout << "Levels: " << down_sx->GetLevel() << " (16384 slots), " << down_sx_full->GetLevel() << " (full-slot)" << endl;
+
+    controller.print(down_sx, 16, "Sx, 16384 slots: ");
+    controller.print(down_sx_full, 16, "Sx, full-slot:   ");
+    controller.print(down_dx, 16, "Dx, 16384 slots: ");
+    controller.print(down_dx_full, 16, "Dx, full-slot:   ");
 }
 
-Ctxt initial_layer(const Ctxt& in) {
+Ctxt initial_layer(const Ctxt& in, double output_scale) {
     double scale = 0.90;
 
     Ctxt res = controller.convbn_initial(in, scale, verbose > 1);
-    res = controller.relu(res, scale, verbose > 1);
+    res = controller.relu(res, scale, verbose > 1, output_scale);
 
     return res;
 }
 
 Ctxt final_layer(const Ctxt& in) {
-    controller.clear_bootstrapping_and_rotation_keys(4096);
-    controller.load_rotation_keys("rotations-finallayer.bin", false);
-
     controller.num_slots = 4096;
 
-    Ptxt weight = controller.encode(read_fc_weight("../weights/fc.bin"), in->GetLevel(), controller.num_slots);
+    //The last layer needs a single multiplication, so all its rotations can work on the last towers only
+    Ctxt res = controller.level_reduce(in, 1);
+    if (verbose > 1 && !controller.dry_run) {
+        cout << "Towers before avgpool_fc: " << res->GetElements()[0].GetNumOfElements() << endl;
+    }
 
-    Ctxt res = controller.rotsum(in, 64);
-    res = controller.mult(res, controller.mask_mod(64, res->GetLevel(), 1.0 / 64.0));
+    //Average pooling and fully connected layer are evaluated as a single linear map, using layer 3 keys
+    res = controller.avgpool_fc(res, verbose > 1);
 
-    //From here, I need 10 repetitons, but I use 16 since *repeat* goes exponentially
-    res = controller.repeat(res, 16);
-    res = controller.mult(res, weight);
-    res = controller.rotsum_padded(res, 64);
+    if (controller.dry_run) return res;
 
     if (verbose >= 0) {
         cout << "Decrypting the output..." << endl;
@@ -230,6 +488,7 @@ Ctxt final_layer(const Ctxt& in) {
     }
 
     vector<double> clear_result = controller.decrypt_tovector(res, 10);
+    last_output = clear_result;
 
     //Index of the max element
     auto max_element_iterator = std::max_element(clear_result.begin(), clear_result.end());
@@ -254,24 +513,47 @@ Ctxt final_layer(const Ctxt& in) {
 Ctxt layer3(const Ctxt& in) {
     double scaleSx = 0.63;
     double scaleDx = 0.40;
+    double shortcut2 = 0.33, shortcut3 = 0.1;
 
     bool timing = verbose > 1;
 
     if (verbose > 1) cout << "---Start: Layer3 - Block 1---" << endl;
+    controller.tracer.begin_scope("Block 1");
     auto start = start_time();
     Ctxt boot_in = controller.bootstrap(in, timing);
 
-    vector<Ctxt> res1sx = controller.convbn3264sx(boot_in, 7, 1, scaleSx, timing); //Questo è lento
-    vector<Ctxt> res1dx = controller.convbn3264dx(boot_in, 7, 1, scaleDx, timing); //Questo è lento
+    Ctxt fullpackSx, fullpackDx;
 
-    controller.clear_bootstrapping_and_rotation_keys(8192);
-    controller.load_rotation_keys("rotations-layer3-downsample.bin", timing);
+    //The downsampling keys are read from disk while the convolutions are computed
+    controller.prefetch_rotation_keys("rotations-layer3-downsample.bin");
 
-    //N.B. questo downsampling usa un chain index in meno - posso accelerare convbn3264sx
-    Ctxt fullpackSx = controller.downsample256to64(res1sx[0], res1sx[1]);
-    Ctxt fullpackDx = controller.downsample256to64(res1dx[0], res1dx[1]);
-    res1sx.clear();
-    res1dx.clear();
+    if (full_slot) {
+        //Both groups of 32 channels in a single 16384 slots ciphertext, ready to be downsampled
+        Ctxt res1sx = controller.convbn3264sxV2(boot_in, 7, 1, scaleSx, timing);
+        Ctxt res1dx = controller.convbn3264dxV2(boot_in, 7, 1, scaleDx, timing);
+
+        controller.clear_bootstrapping_and_rotation_keys(8192);
+        controller.load_rotation_keys("rotations-layer3-downsample.bin", timing);
+
+        controller.prefetch_rotation_keys("rotations-layer3.bin");
+
+        fullpackSx = controller.downsample256to64(res1sx);
+        fullpackDx = controller.downsample256to64(res1dx);
+    } else {
+        vector<Ctxt> res1sx = controller.convbn3264sx(boot_in, 7, 1, scaleSx, timing); //Questo è lento
+        vector<Ctxt> res1dx = controller.convbn3264dx(boot_in, 7, 1, scaleDx, timing); //Questo è lento
+
+        controller.clear_bootstrapping_and_rotation_keys(8192);
+        controller.load_rotation_keys("rotations-layer3-downsample.bin", timing);
+
+        controller.prefetch_rotation_keys("rotations-layer3.bin");
+
+        //N.B. questo downsampling usa un chain index in meno - posso accelerare convbn3264sx
+        fullpackSx = controller.downsample256to64(res1sx[0], res1sx[1]);
+        fullpackDx = controller.downsample256to64(res1dx[0], res1dx[1]);
+        res1sx.clear();
+        res1dx.clear();
+    }
 
     controller.clear_rotation_keys();
     controller.load_bootstrapping_and_rotation_keys("rotations-layer3.bin", 4096, verbose > 1);
@@ -281,51 +563,58 @@ Ctxt layer3(const Ctxt& in) {
 
     fullpackSx = controller.relu(fullpackSx, scaleSx, timing);
     fullpackSx = controller.convbn3(fullpackSx, 7, 2, scaleDx, timing);
-    Ctxt res1 = controller.add(fullpackSx, fullpackDx);
-    res1 = controller.bootstrap(res1, timing);
-    res1 = controller.relu(res1, scaleDx, timing);
+    controller.add_residual(fullpackSx, fullpackDx);
+    Ctxt res1 = controller.bootstrap(fullpackSx, timing);
+    res1 = controller.relu(res1, scaleDx, timing, shortcut2);
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer3 - Block 1---" << endl;
+    controller.tracer.end_scope();
 
     double scale = 0.57;
 
 
     if (verbose > 1) cout << "---Start: Layer3 - Block 2---" << endl;
+    controller.tracer.begin_scope("Block 2");
     start = start_time();
     Ctxt res2;
-    res2 = controller.convbn3(res1, 8, 1, scale, timing);
+    res2 = controller.convbn3(res1, 8, 1, scale, timing, shortcut2);
+    res1 = controller.hold_residual(res1);
     res2 = controller.bootstrap(res2, timing);
     res2 = controller.relu(res2, scale, timing);
 
-    scale = 0.33;
+    scale = shortcut2;
 
     res2 = controller.convbn3(res2, 8, 2, scale, timing);
-    res2 = controller.add(res2, controller.mult(res1, scale));
+    controller.add_residual(res2, res1);
     res2 = controller.bootstrap(res2, timing);
-    res2 = controller.relu(res2, scale, timing);
+    res2 = controller.relu(res2, scale, timing, shortcut3);
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer3 - Block 2---" << endl;
+    controller.tracer.end_scope();
 
     scale = 0.69;
 
     if (verbose > 1) cout << "---Start: Layer3 - Block 3---" << endl;
+    controller.tracer.begin_scope("Block 3");
     start = start_time();
     Ctxt res3;
 
-    res3 = controller.convbn3(res2, 9, 1, scale, timing);
+    res3 = controller.convbn3(res2, 9, 1, scale, timing, shortcut3);
+    res2 = controller.hold_residual(res2);
     res3 = controller.bootstrap(res3, timing);
     res3 = controller.relu(res3, scale, timing);
 
-    scale = 0.1;
+    scale = shortcut3;
 
     res3 = controller.convbn3(res3, 9, 2, scale, timing);
-    res3 = controller.add(res3, controller.mult(res2, scale));
+    controller.add_residual(res3, res2);
     res3 = controller.bootstrap(res3, timing);
     res3 = controller.relu(res3, scale, timing);
     res3 = controller.bootstrap(res3, timing);
 
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer3 - Block 3---" << endl;
+    controller.tracer.end_scope();
 
 
     return res3;
@@ -335,28 +624,51 @@ Ctxt layer2(const Ctxt& in) {
 
     double scaleSx = 0.57;
     double scaleDx = 0.40;
+    double shortcut2 = 0.37, shortcut3 = 0.25;
 
 
     bool timing = verbose > 1;
 
     if (verbose > 1) cout << "---Start: Layer2 - Block 1---" << endl;
+    controller.tracer.begin_scope("Block 1");
     auto start = start_time();
     Ctxt boot_in = controller.bootstrap(in, timing);
 
-    vector<Ctxt> res1sx = controller.convbn1632sx(boot_in, 4, 1, scaleSx, timing); //Questo è lento
+    Ctxt fullpackSx, fullpackDx;
 
-    vector<Ctxt> res1dx = controller.convbn1632dx(boot_in, 4, 1, scaleDx, timing); //Questo è lento
+    //The downsampling keys are read from disk while the convolutions are computed
+    controller.prefetch_rotation_keys("rotations-layer2-downsample.bin");
 
+    if (full_slot) {
+        //Both groups of 16 channels in a single 32768 slots ciphertext, ready to be downsampled
+        Ctxt res1sx = controller.convbn1632sxV2(boot_in, 4, 1, scaleSx, timing);
+        Ctxt res1dx = controller.convbn1632dxV2(boot_in, 4, 1, scaleDx, timing);
+
+        controller.clear_bootstrapping_and_rotation_keys(16384);
+        controller.load_rotation_keys("rotations-layer2-downsample.bin", timing);
+
+        controller.prefetch_rotation_keys("rotations-layer2.bin");
+
+        fullpackSx = controller.downsample1024to256(res1sx);
+        fullpackDx = controller.downsample1024to256(res1dx);
+    } else {
+        vector<Ctxt> res1sx = controller.convbn1632sx(boot_in, 4, 1, scaleSx, timing); //Questo è lento
+
+        vector<Ctxt> res1dx = controller.convbn1632dx(boot_in, 4, 1, scaleDx, timing); //Questo è lento
 
-    controller.clear_bootstrapping_and_rotation_keys(16384);
-    controller.load_rotation_keys("rotations-layer2-downsample.bin", timing);
 
-    Ctxt fullpackSx = controller.downsample1024to256(res1sx[0], res1sx[1]);
-    Ctxt fullpackDx = controller.downsample1024to256(res1dx[0], res1dx[1]);
+        controller.clear_bootstrapping_and_rotation_keys(16384);
+        controller.load_rotation_keys("rotations-layer2-downsample.bin", timing);
 
+        controller.prefetch_rotation_keys("rotations-layer2.bin");
 
-    res1sx.clear();
-    res1dx.clear();
+        fullpackSx = controller.downsample1024to256(res1sx[0], res1sx[1]);
+        fullpackDx = controller.downsample1024to256(res1dx[0], res1dx[1]);
+
+
+        res1sx.clear();
+        res1dx.clear();
+    }
 
     controller.clear_rotation_keys();
     controller.load_bootstrapping_and_rotation_keys("rotations-layer2.bin", 8192, verbose > 1);
@@ -368,109 +680,125 @@ Ctxt layer2(const Ctxt& in) {
 
     //I use the scale of the right branch since they will be added together
     fullpackSx = controller.convbn2(fullpackSx, 4, 2, scaleDx, timing);
-    Ctxt res1 = controller.add(fullpackSx, fullpackDx);
-    res1 = controller.bootstrap(res1, timing);
-    res1 = controller.relu(res1, scaleDx, timing);
+    controller.add_residual(fullpackSx, fullpackDx);
+    Ctxt res1 = controller.bootstrap(fullpackSx, timing);
+    res1 = controller.relu(res1, scaleDx, timing, shortcut2);
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer2 - Block 1---" << endl;
+    controller.tracer.end_scope();
 
     double scale = 0.76;
 
     if (verbose > 1) cout << "---Start: Layer2 - Block 2---" << endl;
+    controller.tracer.begin_scope("Block 2");
     start = start_time();
     Ctxt res2;
-    res2 = controller.convbn2(res1, 5, 1, scale, timing);
+    res2 = controller.convbn2(res1, 5, 1, scale, timing, shortcut2);
+    res1 = controller.hold_residual(res1);
     res2 = controller.bootstrap(res2, timing);
     res2 = controller.relu(res2, scale, timing);
 
-    scale = 0.37;
+    scale = shortcut2;
 
     res2 = controller.convbn2(res2, 5, 2, scale, timing);
-    res2 = controller.add(res2, controller.mult(res1, scale));
+    controller.add_residual(res2, res1);
     res2 = controller.bootstrap(res2, timing);
-    res2 = controller.relu(res2, scale, timing);
+    res2 = controller.relu(res2, scale, timing, shortcut3);
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer2 - Block 2---" << endl;
+    controller.tracer.end_scope();
 
     scale = 0.63;
 
     if (verbose > 1) cout << "---Start: Layer2 - Block 3---" << endl;
+    controller.tracer.begin_scope("Block 3");
     start = start_time();
     Ctxt res3;
-    res3 = controller.convbn2(res2, 6, 1, scale, timing);
+    res3 = controller.convbn2(res2, 6, 1, scale, timing, shortcut3);
+    res2 = controller.hold_residual(res2);
     res3 = controller.bootstrap(res3, timing);
     res3 = controller.relu(res3, scale, timing);
   
-    scale = 0.25;
+    scale = shortcut3;
 
     res3 = controller.convbn2(res3, 6, 2, scale, timing);
-    res3 = controller.add(res3, controller.mult(res2, scale));
+    controller.add_residual(res3, res2);
     res3 = controller.bootstrap(res3, timing);
     res3 = controller.relu(res3, scale, timing);
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer2 - Block 3---" << endl;
+    controller.tracer.end_scope();
 
     return res3;
 }
 
-Ctxt layer1(const Ctxt& in) {
+Ctxt layer1(Ctxt in) {
     bool timing = verbose > 1;
     double scale = 1.00;
+    double shortcut2 = 0.36, shortcut3 = 0.42;
 
 
     if (verbose > 1) cout << "---Start: Layer1 - Block 1---" << endl;
+    controller.tracer.begin_scope("Block 1");
     auto start = start_time();
     Ctxt res1;
-    res1 = controller.convbn(in, 1, 1, scale, timing);
+    res1 = controller.convbn(in, 1, 1, scale, timing, layer1_shortcut_scale);
     res1 = controller.bootstrap(res1, timing);
     res1 = controller.relu(res1, scale, timing);
 
-    scale = 0.52;
+    scale = layer1_shortcut_scale;
 
     res1 = controller.convbn(res1, 1, 2, scale, timing);
-    res1 = controller.add(res1, controller.mult(in, scale));
+    controller.add_residual(res1, in);
     res1 = controller.bootstrap(res1, timing);
-    res1 = controller.relu(res1, scale, timing);
+    res1 = controller.relu(res1, scale, timing, shortcut2);
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer1 - Block 1---" << endl;
+    controller.tracer.end_scope();
 
     scale = 0.55;
 
 
     if (verbose > 1) cout << "---Start: Layer1 - Block 2---" << endl;
+    controller.tracer.begin_scope("Block 2");
     start = start_time();
     Ctxt res2;
-    res2 = controller.convbn(res1, 2, 1, scale, timing);
+    res2 = controller.convbn(res1, 2, 1, scale, timing, shortcut2);
+    res1 = controller.hold_residual(res1);
     res2 = controller.bootstrap(res2, timing);
     res2 = controller.relu(res2, scale, timing);
 
-    scale = 0.36;
+    scale = shortcut2;
 
     res2 = controller.convbn(res2, 2, 2, scale, timing);
-    res2 = controller.add(res2, controller.mult(res1, scale));
+    controller.add_residual(res2, res1);
     res2 = controller.bootstrap(res2, timing);
-    res2 = controller.relu(res2, scale, timing);
+    res2 = controller.relu(res2, scale, timing, shortcut3);
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer1 - Block 2---" << endl;
+    controller.tracer.end_scope();
   
     scale = 0.63;
 
     if (verbose > 1) cout << "---Start: Layer1 - Block 3---" << endl;
+    controller.tracer.begin_scope("Block 3");
     start = start_time();
     Ctxt res3;
-    res3 = controller.convbn(res2, 3, 1, scale, timing);
+    res3 = controller.convbn(res2, 3, 1, scale, timing, shortcut3);
+    res2 = controller.hold_residual(res2);
     res3 = controller.bootstrap(res3, timing);
     res3 = controller.relu(res3, scale, timing);
 
-    scale = 0.42;
+    scale = shortcut3;
   
     res3 = controller.convbn(res3, 3, 2, scale, timing);
-    res3 = controller.add(res3, controller.mult(res2, scale));
+    controller.add_residual(res3, res2);
     res3 = controller.bootstrap(res3, timing);
     res3 = controller.relu(res3, scale, timing);
 
     if (verbose > 1) print_duration(start, "Total");
     if (verbose > 1) cout << "---End  : Layer1 - Block 3---" << endl;
+    controller.tracer.end_scope();
 
     return res3;
 }
@@ -538,6 +866,7 @@ void check_arguments(int argc, char *argv[]) {
         if (string(argv[i]) == "input") {
             if (i + 1 < argc) {
                 input_filename = "../" + string(argv[i + 1]);
+                input_filenames.push_back(input_filename);
                 if (verbose > 1) cout << "Input image set to: \"" << input_filename << "\"." << endl;
             }
         }
@@ -546,6 +875,123 @@ void check_arguments(int argc, char *argv[]) {
             plain = true;
         }
 
+        if (string(argv[i]) == "key_store") {
+            controller.use_key_store = true;
+        }
+
+        if (string(argv[i]) == "seeded") {
+            controller.use_seeded_keys = true;
+        }
+
+        if (string(argv[i]) == "raw") {
+            controller.use_raw_format = true;
+        }
+
+        if (string(argv[i]) == "binary_keys") {
+            controller.use_binary_keys = true;
+        }
+
+        if (string(argv[i]) == "trace") {
+            if (i + 1 < argc) {
+                trace_filename = "../" + string(argv[i + 1]);
+                controller.tracer.enabled = true;
+            }
+        }
+
+        if (string(argv[i]) == "timings") {
+            if (i + 1 < argc) {
+                timings_filename = "../" + string(argv[i + 1]);
+                controller.tracer.enabled = true;
+            }
+        }
+
+        if (string(argv[i]) == "dry_run") {
+            controller.dry_run = true;
+            if (i + 1 < argc && !controller.cost_model.load_timings("../" + string(argv[i + 1]))) {
+                cerr << "Could not read the timings in \"../" << argv[i + 1] << "\", only the keys will be predicted" << endl;
+            }
+        }
+
+        if (string(argv[i]) == "plan_keys") {
+            if (i + 1 < argc) {
+                key_budget_mb = atof(argv[i + 1]);
+            }
+        }
+
+        if (string(argv[i]) == "calibrate_bootstrap") {
+            if (i + 1 < argc && atof(argv[i + 1]) > 0) {
+                controller.bootstrap_required_bits = atof(argv[i + 1]);
+            } else {
+                cerr << "Set the precision required by 'calibrate_bootstrap', in bits. Check the README.md" << endl;
+                exit(1);
+            }
+        }
+
+        if (string(argv[i]) == "counters") {
+            //Here no OpenMP thread exists yet, so all of them will inherit the counters
+            controller.tracer.enable_counters();
+        }
+
+        if (string(argv[i]) == "memory") {
+            monitor_memory = true;
+        }
+
+        if (string(argv[i]) == "no_checkpoints") {
+            checkpoints = false;
+        }
+
+        if (string(argv[i]) == "no_mask_cache") {
+            controller.use_mask_cache = false;
+        }
+
+        if (string(argv[i]) == "resume") {
+            resume = true;
+        }
+
+        if (string(argv[i]) == "weights" || string(argv[i]) == "convert_weights") {
+            if (i + 1 < argc && weightpack::valid_format(argv[i + 1])) {
+                if (string(argv[i]) == "weights") {
+                    weightpack::format = argv[i + 1];
+                } else {
+                    convert_weights_format = argv[i + 1];
+                }
+            } else {
+                cerr << "Set a proper value for '" << argv[i] << "', either 'f32' or 'bf16'. Check the README.md" << endl;
+                exit(1);
+            }
+        }
+
+        if (string(argv[i]) == "verify_weights") {
+            verify_weights = true;
+        }
+
+        if (string(argv[i]) == "workers") {
+            if (i + 1 < argc) {
+                workers = atoi(argv[i + 1]);
+            }
+        }
+
+        if (string(argv[i]) == "huge_pages" || string(argv[i]) == "benchmark_huge_pages") {
+            if (hugepages::available()) {
+                controller.use_huge_pages = true;
+                benchmark_huge_pages = string(argv[i]) == "benchmark_huge_pages";
+            } else {
+                cerr << "Transparent huge pages are disabled, using normal pages" << endl;
+            }
+        }
+
+        if (string(argv[i]) == "benchmark_seeded") {
+            benchmark_seeded = true;
+        }
+
+        if (string(argv[i]) == "full_slot") {
+            full_slot = true;
+        }
+
+        if (string(argv[i]) == "benchmark_packing") {
+            benchmark_packing = true;
+        }
+
     }
 
 }